@@ -5,11 +5,23 @@
 #include "main_header.h"
 
 
+/** Somma ai contatori di wat le variazioni accumulate dai worker e le azzera
+ *	Va chiamata a chronon concluso: ogni worker ha scritto le proprie prima di notificarlo al collector
+ *	param wat: wator i cui contatori aggiornare
+ */
+static void merge_counters( wator_t *wat ){
+	int i;
+	for ( i=0; i<wat->nwork; i++ ){
+		wat->nf += workers[i].dnf;
+		wat->ns += workers[i].dns;
+		workers[i].dnf = workers[i].dns = 0;
+	}
+}
+
 void* main_collector( void* args ){
 	Elem END_EVENT_LOOP = 0;
 	int *wid;
-	int count = 0;
-	int update_passed = 0;
+	wide_t count = 0;
 	wator_t *wat = (wator_t*)syc_wator->sharedItem ;
 	
 	/* inizializzo i segnali */ 
@@ -25,31 +37,37 @@ void* main_collector( void* args ){
 				END_EVENT_LOOP = (Elem)1; break;
 			case EVENT_QUEUE_MSG_SHOW:
 				Log("Collector <- MSG_SHOW", DEBUG, NOPERROR);
-				/* ricebuta la richiesta di visualizzare il pianeta, invio la sua immagine a visualizer*/
-				show( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol );			
+				/* ricebuta la richiesta di visualizzare il pianeta, consegno la sua immagine secondo la politica scelta */
+				show_frame( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol, 0 );
 				/* dopo aver fatto la visualizzazione posso richiedere un nuovo aggiornamento. */	
 				sycqueue_enqueue( EVENT_QUEUE, (Elem) EVENT_QUEUE_MSG_REQUEST_UPDATE );
 				Log("Collector: MSG_REQUEST_UPDATE --> Main thread",DEBUG, NOPERROR);
 				break;
 			case EVENT_QUEUE_MSG_LAST_SHOW:
 				Log("Collector <- MSG_LAST_SHOW", DEBUG, NOPERROR);
-				/* ricebuta la richiesta di visualizzare il pianeta, invio la sua immagine a visualizer*/
-				show( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol );				
+				/* ricebuta la richiesta di visualizzare il pianeta, l'ultima immagine non può esser scartata */
+				show_frame( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol, 1 );
 				break;
 			default: 
 				/*Log("Collector <- Worker", DEBUG, NOPERROR );*/
 				/* verifico che l'update non sia terminato, se lo fosse lo notifico al dispacher */
-				if ( (++count) == num_of_subs ){
+				if ( (++count) == tiles_dispatched ){
 					/* ho ricevuto il lavoro da tutti i worker, non ne dovrebbe arrivare più nessun altro */
 					count = 0;
+					/* nessun worker sta lavorando: sommo ai contatori le variazioni di ognuno */
+					merge_counters( wat );
 					
-					/* faccio il clear dello status delle celle nelle zone condivse ( ora tutti i worker hanno finito di lavorare ) */
-					while ( ! sycqueue_isEmpty( toClean ) )
-						* (cell_state_t*) sycqueue_dequeue( toClean ) = UNKNOWN;
-						
-					/* controllo se sia il caso di visualizzare la matrice */
-					if ( ( ++update_passed ) == wat->chronon ){
-						update_passed = 0;
+					/* owner computes: conclusa la prima fase il chronon prosegue con la seconda */
+					if ( owner_computes && owner_phase == OWNER_UPDATE ){
+						sycqueue_enqueue( TO_DISPACHER_QUEUE, (Elem)EVENT_QUEUE_MSG_DISPACHER_APPLY );
+						Log("Collector: MSG_APPLY --> Dispacher",DEBUG, NOPERROR);
+						break;
+					}
+
+					/* gli stati delle celle sono marcati col chronon: con il prossimo tornano UNKNOWN da soli */
+					/* controllo se sia il caso di visualizzare la matrice: lo decide il chronon appena concluso,
+					 * come per il dispacher ( encode_round ), anche dopo una ripresa da checkpoint */
+					if ( current_chronon % wat->chronon == 0 ){
 						/* mi segno di dover visualizzare */
 						sycqueue_enqueue( TO_COLLECTOR_QUEUE, (Elem)EVENT_QUEUE_MSG_SHOW );
 						Log("Collector: MSG_SHOW --> Collector",DEBUG, NOPERROR);
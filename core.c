@@ -6,7 +6,12 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
 
 #include "core.h"
 
@@ -37,9 +42,181 @@ void unlock ( Mutex mutex ) {
 	}
 }
 
-int top(int num, int div){
+LockTable locktable_create( size_t nslots, lock_kind_t kind ){
+	LockTable t;
+	size_t i, n = 1;
+	int err;
+	while ( n < nslots ) n <<= 1;
+	if ( ! ( t = malloc( sizeof(_LockTable) ) ) ) return NULL;
+	/* slot allineati alla linea di cache: due lock non la condividono mai */
+	if (( err = posix_memalign( (void**)&(t->slots), CACHE_LINE, n*sizeof(lock_slot_t) ) )){
+		free( t );
+		errno = err;
+		return NULL;
+	}
+	memset( t->slots, 0, n*sizeof(lock_slot_t) );
+	t->kind = kind;
+	t->nslots = n;
+	if ( kind == LOCK_MUTEX )
+		for ( i=0; i<n; i++ )
+			if (( err = pthread_mutex_init( &(t->slots[i].mutex), NULL ) )){
+				while ( i-- ) pthread_mutex_destroy( &(t->slots[i].mutex) );
+				free( t->slots );
+				free( t );
+				errno = err;
+				return NULL;
+			}
+	return t;
+}
+
+void locktable_destroy( LockTable t ){
+	size_t i;
+	if ( ! t ) return;
+	if ( t->kind == LOCK_MUTEX )
+		for ( i=0; i<t->nslots; i++ ) pthread_mutex_destroy( &(t->slots[i].mutex) );
+	free( t->slots );
+	free( t );
+}
+
+lock_slot_t *locktable_slot( LockTable t, size_t index ){
+	/* hash moltiplicativo ( Fibonacci ): indici vicini finiscono in slot lontani */
+	uint64_t h = (uint64_t)index * UINT64_C(11400714819323198485);
+	return t->slots + ( ( h >> 32 ) & ( t->nslots - 1 ) );
+}
+
+/** prende il lock di uno slot */
+static void slot_lock( LockTable t, lock_slot_t *s ){
+	unsigned int ticket;
+	unsigned char free_byte;
+	switch ( t->kind ){
+		case LOCK_MUTEX: lock( &(s->mutex) ); break;
+		case LOCK_TICKET:
+			ticket = __atomic_fetch_add( &(s->ticket.next), 1, __ATOMIC_RELAXED );
+			while ( __atomic_load_n( &(s->ticket.serving), __ATOMIC_ACQUIRE ) != ticket ) sched_yield();
+			break;
+		case LOCK_BYTE:
+			free_byte = 0;
+			while ( ! __atomic_compare_exchange_n( &(s->byte), &free_byte, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ){
+				/* attendo leggendo soltanto, per non contendere la linea di cache */
+				while ( __atomic_load_n( &(s->byte), __ATOMIC_RELAXED ) ) sched_yield();
+				free_byte = 0;
+			}
+			break;
+	}
+}
+
+/** rilascia il lock di uno slot */
+static void slot_unlock( LockTable t, lock_slot_t *s ){
+	switch ( t->kind ){
+		case LOCK_MUTEX: unlock( &(s->mutex) ); break;
+		case LOCK_TICKET:
+			/* solo chi ha il lock scrive serving */
+			__atomic_store_n( &(s->ticket.serving), s->ticket.serving + 1, __ATOMIC_RELEASE );
+			break;
+		case LOCK_BYTE: __atomic_store_n( &(s->byte), 0, __ATOMIC_RELEASE ); break;
+	}
+}
+
+int locktable_lock_all( LockTable t, lock_slot_t *s[], int n ){
+	int i, j, m = 0;
+	/* insertion sort degli slot non nulli, scartando i doppioni ( n è piccolo ) */
+	for ( i=0; i<n; i++ ){
+		lock_slot_t *x = s[i];
+		if ( ! x ) continue;
+		for ( j=m; j>0 && s[j-1] > x; j-- ) s[j] = s[j-1];
+		if ( j>0 && s[j-1] == x ){
+			/* doppione: annullo lo spostamento */
+			for ( ; j<m; j++ ) s[j] = s[j+1];
+			continue;
+		}
+		s[j] = x;
+		m++;
+	}
+	/* l'ordine globale degli slot esclude la deadlock */
+	for ( i=0; i<m; i++ ) slot_lock( t, s[i] );
+	return m;
+}
+
+void locktable_unlock_all( LockTable t, lock_slot_t *s[], int n ){
+	while ( n-- ) slot_unlock( t, s[n] );
+}
+
+Arena arena_create( size_t size, int flags ){
+	static long page = 0;
+	Arena a = MAP_FAILED;
+	size_t len;
+	if ( ! page ) page = sysconf( _SC_PAGESIZE );
+	size += sizeof(_Arena);
+	#ifdef MAP_HUGETLB
+	if ( flags & ARENA_HUGE ){
+		/* le pagine grandi vanno riservate dall'amministratore: se non ce ne sono abbastanza fallisce */
+		len = ( size + HUGE_PAGE-1 ) & ~( HUGE_PAGE-1 );
+		a = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	}
+	#endif
+	if ( a == MAP_FAILED ){
+		len = ( size + page-1 ) & ~(size_t)( page-1 );
+		if ( ( a = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 ) ) == MAP_FAILED )
+			return NULL;
+		#ifdef MADV_HUGEPAGE
+		/* solo un consiglio: se le transparent huge pages sono disabilitate non cambia niente */
+		if ( flags & ARENA_HUGE ) madvise( a, len, MADV_HUGEPAGE );
+		#endif
+		a->huge = 0;
+	}else a->huge = 1;
+	a->size = len;
+	arena_reset( a );
+	return a;
+}
+
+void *arena_alloc( Arena a, size_t size, size_t align ){
+	size_t from;
+	if ( ! align ) align = 2*sizeof(void*);
+	from = ( a->used + align-1 ) & ~( align-1 );
+	if ( from > a->size || size > a->size - from ){
+		errno = ENOMEM;
+		return NULL;
+	}
+	a->used = from + size;
+	return (char*)a + from;
+}
+
+void arena_reset( Arena a ){
+	/* il descrittore resta al suo posto */
+	a->used = sizeof(_Arena);
+}
+
+Arena arena_create_file( const char *file, size_t size ){
+	static long page = 0;
+	Arena a;
+	size_t len;
+	int fd, err;
+	if ( ! page ) page = sysconf( _SC_PAGESIZE );
+	len = ( size + sizeof(_Arena) + page-1 ) & ~(size_t)( page-1 );
+	/* troncato: un file rimasto da un'esecuzione precedente non deve lasciare il suo contenuto */
+	if ( ( fd = open( file, O_RDWR | O_CREAT | O_TRUNC, 0600 ) ) < 0 ) return NULL;
+	/* la mappatura tiene in vita il file anche dopo averlo eliminato */
+	unlink( file );
+	if ( ftruncate( fd, len ) || ( a = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ){
+		err = errno;
+		close( fd );
+		errno = err;
+		return NULL;
+	}
+	close( fd );
+	a->huge = 0;
+	a->size = len;
+	arena_reset( a );
+	return a;
+}
+
+void arena_destroy( Arena a ){
+	if ( a ) munmap( a, a->size );
+}
+
+wide_t top(wide_t num, wide_t div){
 	/* divido e sommo 1 se c'è un resto, 0 altrimenti */
-	return (int)(num/div) + ( (num%div) ? 1 : 0 ) ;
+	return num/div + ( (num%div) ? 1 : 0 ) ;
 }
 
 /********************************************************************************************************************************* /
@@ -114,17 +291,22 @@ int testMinus( int value , const char msg [] , Log_mode mode ){
 
 
 Queue queue_create (){
-	Queue que = testedMalloc ( sizeof( Queue ) );
+	Queue que = testedMalloc ( sizeof( queue_t ) );
 	/* coda vuota */
-	que->head = que->tail = NULL;
+	que->head = que->tail = que->spare = NULL;
 	return que;
 }
 
 void queue_destroy ( Queue que ){
 	/* controllo sul parametro */
 	testNull( que, "Destroy called on NULL", NOPERROR);
-	/* rimuovo tutti gli elementi dalla coda e poi libero la coda */
+	/* rimuovo tutti gli elementi dalla coda, libero i nodi da riusare e poi la coda */
 	queue_clear( que );
+	while ( que->spare ){
+		Node *node = que->spare;
+		que->spare = node->next;
+		free( node );
+	}
 	free(que);
 }
 
@@ -134,8 +316,13 @@ int isEmpty ( Queue que ){
 }
 
 void enqueue( Queue que , Elem value ){
-	Node * node = testedMalloc ( sizeof(Node) );
+	Node * node ;
 	testNull( que , "Enqueue called on NULL", NOPERROR );
+	/* riuso un nodo già estratto: a regime la coda non alloca più */
+	if ( que->spare ){
+		node = que->spare;
+		que->spare = node->next;
+	}else node = testedMalloc ( sizeof(Node) );
 	
 	/* nuovo nodo */
 	node->next = NULL;
@@ -165,9 +352,10 @@ Elem dequeue( Queue que, Elem defau ) {
 	que->head = que->head->next;
 	if (que->head== NULL) que->tail = NULL; /* Empty */	
 	
-	/* salvo il valore e libero il nodo */
+	/* salvo il valore e metto da parte il nodo per la prossima enqueue */
 	ret = node->info ;
-	free ( node );
+	node->next = que->spare;
+	que->spare = node;
 	
 	return ret;
 }
@@ -213,10 +401,11 @@ SycCont syc_create( Ide shared ){
 	return syc;
 }
 void syc_destroy( SycCont syc ){
-	/* distrugge correttamente syc */
-	free( testNull( syc , "Called Destroy on NULL SYC", NOPERROR) );
+	/* distrugge correttamente syc: prima i campi, poi il contenitore */
+	testNull( syc , "Called Destroy on NULL SYC", NOPERROR);
 	free( testNull( syc->mutex , "Called Destroy on NULL SYC->Mutex", NOPERROR) );
 	free( testNull( syc->cond_var , "Called Destroy on NULL SYC->Cond_Var", NOPERROR) );
+	free( syc );
 }
 
 /********************************************************************************************************************************* /
@@ -319,53 +508,14 @@ const unsigned char SHIFT[]={
 /* ottiene il valore dei due bit in posizione i su c */
 #define GETPOS(c,i) ( (c&MASK[i])>>SHIFT[i] ) 
 
-/* struttra che indica una cella ed il numero di volte che occorre */
-typedef struct {
-	cell_t cell;
-	int count;
-} cellOccs;
-
-/* funzione static che crea una struttura cellOccs inizializzata coi parametri omonimi*/
-cellOccs makecelloccs( cell_t cell , int count ){
-	cellOccs o;
-	o.cell = cell;
-	o.count = count;
-	return o;
-}
-
-/** funzione che dato un array di cellOccs preventivamente allocato, 
- * 	lo riempie con le coppie che occorrono in origin,
- *	=> compatta origin associando alla celle il numero di ripetizioni contigue.
- * param occ: array da riempire
- * param origin: array da cui attingere
- * param dim: lunghezza di origin
- * retval: numero di elementi inseriti in occ
- */
-int countOcc ( cellOccs *occ , cell_t *origin, int dim ) {
-	/* assumo che almeno un carattere ci sia */
-	int len = 1;
-	int i;
-	/* la prima coppia è il primo elemento con occorrenza 1 */
-	occ[0] = makecelloccs( origin[0], 1 );
-	for ( i=1; i<dim ; i++ ) 
-		/* fin tanto che ci sono elementi */ 
-		if ( occ[len-1].cell == origin[i] ) 
-			/* se l'ultima coppia inserita ha lo stesso valore cell ne incremento l'occorrenza*/ 
-			occ[len-1].count++;
-		else
-			/* altrimenti inserisco una nuova coppia con occorrenza 1 */
-			occ[len++] = makecelloccs( origin[i], 1 ); 
-	return len;
-}
-
 /**	scrive su buffer preallocato, a partire dalla posizione pos, che però è intesa come la posizione dei due bits
  *	quindi pos NON è il numero di byte occupati in buffer. 
  *	param buffer: array in cui scrivere
  *	param bits: bits da scrivere ( solo due bit )
  *	param pos: posizione all'interno di buffer in cui scrivere bits
  */
-void WRITE( bits_t buffer[], bits_t bits, int pos ) {
-	int i = pos>>2; /* pos / 4 definisce l'indice del byte di buffer in cui si scrive*/
+void WRITE( bits_t buffer[], bits_t bits, wide_t pos ) {
+	wide_t i = pos>>2; /* pos / 4 definisce l'indice del byte di buffer in cui si scrive*/
 	int j = pos&3;  /* pos % 4 definisce in quale punto del byte scrivere */
 	if ( j==0 ) buffer[i]=0; /* clear in caso non sia stata fatta precedentemente */
 	bits = bits & 3 ; /* AND con la maschera 00 00 00 11 per sicurezza */
@@ -382,7 +532,7 @@ void WRITE( bits_t buffer[], bits_t bits, int pos ) {
  *	param pos: posizione da cui inziare a scrivere
  *	retval posizione da cui continuare a scrivere
  */
-int write_many_times( bits_t buff[], bits_t bits, int times, int pos ){
+wide_t write_many_times( bits_t buff[], bits_t bits, wide_t times, wide_t pos ){
 	/* special bits che indica che la sequeza succesiva è un moltiplicatore */
 	#define REP (3)
 	/* ciclo fin tanto che non ho terminato di scrivere le volte richieste */
@@ -420,42 +570,29 @@ int write_many_times( bits_t buff[], bits_t bits, int times, int pos ){
  *	param dim: lunghezza della matrice src
  *	retval : lunghezza di dest
  */
-int compress( bits_t dest[], cell_t src[], int dim ){
-	/* array di coppie <carattere, occorrenza> */
-	cellOccs *occ;
-	int occ_len;
-	int dest_len=0;
-	int i;
+wide_t compress( bits_t dest[], cell_t src[], wide_t dim ){
+	wide_t dest_len=0;
+	/* numero di ripetizioni contigue del carattere corrente */
+	wide_t run=1;
+	wide_t i;
 	
 	/* probabile errore */
 	if ( dim < 1 ) Log ( "Compressing a too much short sequence" , FATAL, NOPERROR);
 
-	/* alloco l'array di coppie di supporto e lo inizializzo*/
-	occ = testedMalloc( sizeof(cellOccs)*dim );
-	occ_len = countOcc ( occ, src, dim ) ;
-	
-	#ifdef _DEBUG_COMPRESS_
-	{	
-		int sum = 0;
-		Log( "\n\tCounting...:\n", DEBUG, NOPERROR );
-		for ( i=0; i<occ_len ; i++){ 
-			printf("%c.%d ", cell_to_char(occ[i].cell), occ[i].count );
-			sum+=occ[i].count;
+	/* le ripetizioni sono contate al volo e scritte appena il carattere cambia (o la sequenza finisce):
+	 * non serve un array di appoggio di coppie <carattere, occorrenza>, quindi nessuna malloc.
+	 * La funzione è chiamata anche dai worker su ogni sotto matrice */
+	for ( i=1; i<=dim ; i++ )
+		if ( i<dim && src[i] == src[i-1] )
+			run++;
+		else{
+			dest_len = write_many_times( dest, cell_to_bits( src[i-1] ), run, dest_len );
+			run = 1;
 		}
-		printf("\nSUM:%d\n",sum);
-	}
-	#endif
-	
-	/* per ogni carattere, lo scrivo tante volte, quante indicato nella coppia */
-	dest_len=0;
-	for ( i=0; i<occ_len ; i++ )
-		dest_len = write_many_times( dest, cell_to_bits( occ[i].cell ), occ[i].count, dest_len );
-	/* libero l'array di coppie */
-	free( occ ) ;
 
 	#ifdef _DEBUG_COMPRESS_ 
 		Log( "\n\tCompressed...:\n", DEBUG, NOPERROR );
-		printf("Buffer size: %d, charlen %d\n", dest_len, top(dest_len,4));
+		printf("Buffer size: %lld, charlen %lld\n", (long long)dest_len, (long long)top(dest_len,4));
 		/* size conta qunati bits ci sono (4 per char )*/
 		for ( i=0; i<top(dest_len,4) ; i++){ 
 			printBin( dest[i] );
@@ -477,22 +614,24 @@ typedef enum{
 	MORE_OR_READ
 } dec_state_t;
 
-/** Funzione che decomprime la matrice
- *	param dest: array in cui caricare la matrice decompressa (preallocata)
+/** Funzione che decomprime la matrice, senza scrivere oltre dest_dim celle
+ *	param dest: array in cui caricare la matrice decompressa (preallocata con dest_dim celle)
  *	param src: array di coppie di bit da decomprimere
  *	param src_dim: numero di coppie di bit in src
- *	retval : lunghezza di dest 
+ *	retval : lunghezza di dest, -1 se src è malformata o si decomprime in più di dest_dim celle
  */
-int decompress( cell_t dest[], bits_t src[], int src_dim ){ 
+wide_t decompress_max( cell_t dest[], wide_t dest_dim, bits_t src[], wide_t src_dim ){ 
 	#define REP (3)
+	/* scrive una cella in dest, se c'è ancora posto */
+	#define PUT(cell) do{ if ( len == dest_dim ) return -1; dest[len++] = (cell); }while(0)
 	/* Stato iniziale */
 	dec_state_t state = READ;
-	int len=0;
-	int i;
+	wide_t len=0;
+	wide_t i;
 	/* variabile di appoggio che indica di quanto è stato trovato il moltiplicatore */
-	int fattore;
+	wide_t fattore = 0;
 	/* ricordo l'ultimo carattere letto per moltiplicarlo eventualmente */
-	cell_t lastW;
+	cell_t lastW = WATER;
 
 	#ifdef _DEBUG_COMPRESS_
 	printf("Decompressing...\n");
@@ -505,7 +644,7 @@ int decompress( cell_t dest[], bits_t src[], int src_dim ){
 
 	for ( i=0; i<src_dim; i++ ){
 		/* per ogni cella, calcolo gli indici effettivi */
-		int index = i >> 2 ; /* /4 */
+		wide_t index = i >> 2 ; /* /4 */
 		int inpos = i & 3; /* 00 00 00 11 indice all'interno del char */
 		/* prendo il carattere all'interno di src, otterò due bit */
 		char c = GETPOS( src[index] , inpos );
@@ -515,20 +654,22 @@ int decompress( cell_t dest[], bits_t src[], int src_dim ){
 				/* mi aspetto un carattere o un moltiplicatore */
 				if ( c!=REP )
 					/* ho letto un carattere, lo scrivo in dest */
-					dest[len++] = lastW = bits_to_cell( c );
+					PUT( lastW = bits_to_cell( c ) );
 				else{
 					/* ho letto un fattore, mi aspetto quindi di avere un moltiplicatore dopo */
 					state=LOOK_ADD;				
 					/* base della moltiplicazione 1 (utile per moltiplicazione concatenate)*/
 					fattore=1;
 					/* PER SCRIVERE CCC non usere il rep, per cui le C sono almeno 4 */
-					dest[len++] = bits_to_cell( lastW );
-					dest[len++] = bits_to_cell( lastW );
-					dest[len++] = bits_to_cell( lastW );
+					PUT( bits_to_cell( lastW ) );
+					PUT( bits_to_cell( lastW ) );
+					PUT( bits_to_cell( lastW ) );
 				}
 				break;
 			case LOOK_ADD:
-				/* mi aspetto un numero e lo moltiplico per il fattore */
+				/* mi aspetto un numero e lo moltiplico per il fattore:
+				 * un fattore che non sta in dest è un errore ( e non deve traboccare ) */
+				if ( c && fattore > ( dest_dim - len ) / c ) return -1;
 				fattore *= (c);
 				/* potrei avere ora un'altro moltiplicatore (non in questa versione) o un carattere */
 				state = MORE_OR_READ;
@@ -537,8 +678,8 @@ int decompress( cell_t dest[], bits_t src[], int src_dim ){
 				if ( c!=REP ){
 					/* ho trovato un carattere, consumo il fattore */
 					for ( ; fattore ; fattore -- )
-						dest[len++] = bits_to_cell( lastW );
-					dest[len++] = lastW = bits_to_cell( c );
+						PUT( bits_to_cell( lastW ) );
+					PUT( lastW = bits_to_cell( c ) );
 					/* torno nello stato iniziale */
 					state=READ;
 				}else
@@ -548,14 +689,351 @@ int decompress( cell_t dest[], bits_t src[], int src_dim ){
 		}
 	}
 	/* mi aspetto di finire in uno stato diverso da Look_add, poichè non è previsto dall'automa */
-	if ( state == LOOK_ADD ) Log("BITS BAD FORMATTED, finished with 11", FATAL, NOPERROR);
+	if ( state == LOOK_ADD ) return -1;
 	/* se ho lasciato il moltiplicatore in sospeso, lo consumo */
 	if ( state == MORE_OR_READ )
 		for (; fattore ; fattore -- )
-			dest[len++] = bits_to_cell(lastW);
+			PUT( bits_to_cell(lastW) );
+	return len;
+	#undef PUT
+}
+
+/** Funzione che decomprime la matrice
+ *	param dest: array in cui caricare la matrice decompressa (preallocata)
+ *	param src: array di coppie di bit da decomprimere
+ *	param src_dim: numero di coppie di bit in src
+ *	retval : lunghezza di dest 
+ */
+wide_t decompress( cell_t dest[], bits_t src[], wide_t src_dim ){ 
+	wide_t len = decompress_max( dest, INT64_MAX, src, src_dim );
+	if ( len < 0 ) Log("BITS BAD FORMATTED, finished with 11", FATAL, NOPERROR);
 	return len;
 }
 
 
 
 
+
+/********************************************************************************************************************************* /
+  *
+  *										FORMATO BINARIO DEL PIANETA
+  *
+/ *********************************************************************************************************************************/
+
+/* numero minimo di celle decompresse da ogni thread durante il caricamento */
+#define BIN_CHUNK_MIN (1<<22)
+#define BIN_MAX_THREADS (64)
+
+/* byte occupati dalle celle impacchettate */
+#define BIN_CELLS_LEN(area) ( ((area)+3)>>2 )
+/* offset delle matrici btime e dtime nel file */
+#define BIN_TIMES_OFFSET(area) ( sizeof(planet_bin_hdr_t) + ( BIN_CELLS_LEN(area)+sizeof(int)-1 )/sizeof(int)*sizeof(int) )
+
+/* porzione di celle [from,to) decompressa da un thread: from è multiplo di 4 */
+typedef struct {
+	const bits_t *src;
+	cell_t *dest;
+	long from, to;
+	int ok;
+} bin_chunk_t;
+
+static void *unpack_chunk( void *arg ){
+	bin_chunk_t *ch = arg;
+	long k;
+	bits_t c;
+	ch->ok = 1;
+	for ( k=ch->from; k<ch->to; k++ ){
+		c = GETPOS( ch->src[k>>2], k&3 );
+		/* la coppia 11 non corrisponde a nessuna cella */
+		if ( c == 3 ) { ch->ok = 0; return NULL; }
+		ch->dest[k] = bits_to_cell( c );
+	}
+	return NULL;
+}
+
+int is_wator_bin( const char *file ){
+	char magic[4];
+	FILE *f = fopen( file, "r" );
+	int ret;
+	if ( ! f ) return 0;
+	ret = fread( magic, 1, 4, f ) == 4 && ! memcmp( magic, PLANET_BIN_MAGIC, 4 );
+	fclose( f );
+	return ret;
+}
+
+wator_t* load_wator_bin( const char *file, sim_state_t *state ){
+	int fd;
+	struct stat st;
+	const char *map;
+	planet_bin_hdr_t hdr;
+	wator_t *pw;
+	long area, need;
+	bin_chunk_t chunks[BIN_MAX_THREADS];
+	pthread_t tid[BIN_MAX_THREADS];
+	int n, i, created, ok = 1;
+
+	if ( ( fd = open( file, O_RDONLY ) ) < 0 ) return NULL;
+	if ( fstat( fd, &st ) || st.st_size < sizeof(planet_bin_hdr_t) ){
+		close( fd );
+		errno = ERANGE;
+		return NULL;
+	}
+	/* il file non viene letto: le pagine sono caricate dal kernel solo quando vengono toccate */
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( map == MAP_FAILED ) return NULL;
+	madvise( (void*)map, st.st_size, MADV_SEQUENTIAL );
+
+	memcpy( &hdr, map, sizeof(hdr) );
+	area = (long)hdr.nrow * hdr.ncol;
+	need = ( hdr.flags & PLANET_BIN_TIMES ) ? BIN_TIMES_OFFSET(area) + 2*area*sizeof(int) : sizeof(hdr) + BIN_CELLS_LEN(area);
+	if ( hdr.flags & PLANET_BIN_STATE )
+		need = ( hdr.flags & PLANET_BIN_TIMES ) ? need + sizeof(sim_state_t) : st.st_size+1;
+	if ( memcmp( hdr.magic, PLANET_BIN_MAGIC, 4 ) || ! area || st.st_size < need
+	|| ! ( pw = malloc( sizeof(wator_t) ) ) ){
+		munmap( (void*)map, st.st_size );
+		errno = ERANGE;
+		return NULL;
+	}
+	pw->sd = hdr.sd;
+	pw->sb = hdr.sb;
+	pw->fb = hdr.fb;
+	pw->nf = pw->ns = pw->nwork = pw->chronon = 0;
+	if ( ! ( pw->plan = new_planet( hdr.nrow, hdr.ncol ) ) ){
+		free( pw );
+		munmap( (void*)map, st.st_size );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* un thread per processore, ognuno su almeno BIN_CHUNK_MIN celle */
+	n = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( n > area/BIN_CHUNK_MIN ) n = area/BIN_CHUNK_MIN;
+	if ( n > BIN_MAX_THREADS ) n = BIN_MAX_THREADS;
+	if ( n < 1 ) n = 1;
+	for ( i=0; i<n; i++ ){
+		chunks[i].src = (const bits_t*)( map + sizeof(hdr) );
+		chunks[i].dest = pw->plan->w[0];
+		chunks[i].from = ( i==0 ) ? 0 : chunks[i-1].to;
+		chunks[i].to = ( i==n-1 ) ? area : ( area/n*(i+1) ) & ~3L;
+		chunks[i].ok = 0;
+	}
+	for ( created=1; created<n; created++ )
+		if ( pthread_create( tid+created, NULL, unpack_chunk, chunks+created ) ) { ok = 0; break; }
+	unpack_chunk( chunks );
+	for ( i=1; i<created; i++ )
+		pthread_join( tid[i], NULL );
+	for ( i=0; ok && i<n; i++ )
+		ok = chunks[i].ok;
+
+	/* le matrici sono contigue (vedi new_planet) */
+	if ( ok && ( hdr.flags & PLANET_BIN_TIMES ) ){
+		memcpy( pw->plan->btime[0], map + BIN_TIMES_OFFSET(area), area*sizeof(int) );
+		memcpy( pw->plan->dtime[0], map + BIN_TIMES_OFFSET(area) + area*sizeof(int), area*sizeof(int) );
+	}
+	if ( state ){
+		if ( hdr.flags & PLANET_BIN_STATE )
+			memcpy( state, map + BIN_TIMES_OFFSET(area) + 2*area*sizeof(int), sizeof(sim_state_t) );
+		else
+			state->chronon = -1;
+	}
+	munmap( (void*)map, st.st_size );
+	if ( ! ok ){
+		free_wator( pw );
+		errno = ERANGE;
+		return NULL;
+	}
+	pw->ns = shark_count( pw->plan );
+	pw->nf = fish_count( pw->plan );
+	return pw;
+}
+
+/* byte occupati dalle celle impacchettate di n celle, allineati a sizeof(int) */
+#define RECT_CELLS_LEN(n) ( ( BIN_CELLS_LEN(n)+sizeof(int)-1 )/sizeof(int)*sizeof(int) )
+
+/** Scrive su f le celle del rettangolo r di p, impacchettate 4 per byte nello stesso ordine di WRITE
+ *	riga per riga, e se times anche le sue btime e dtime (dopo il riempimento fino all'allineamento)
+ *	retval: 1 se la scrittura è riuscita, 0 altrimenti
+ */
+static int put_rect( FILE *f, planet_t *p, const planet_rect_t *r, int times ){
+	long n = (long)r->nrow * r->ncol;
+	long k, pad;
+	int i, ok = 1;
+	bits_t byte = 0;
+	for ( k=0; ok && k<n; k++ ){
+		byte |= cell_to_bits( p->w[r->row + k/r->ncol][r->col + k%r->ncol] ) << SHIFT[k&3];
+		if ( (k&3) == 3 || k == n-1 ){
+			ok = putc( byte, f ) != EOF;
+			byte = 0;
+		}
+	}
+	if ( ! times ) return ok;
+	for ( pad=RECT_CELLS_LEN(n)-BIN_CELLS_LEN(n); ok && pad; pad-- )
+		ok = putc( 0, f ) != EOF;
+	for ( i=0; ok && i<r->nrow; i++ )
+		ok = fwrite( p->btime[r->row+i] + r->col, sizeof(int), r->ncol, f ) == r->ncol;
+	for ( i=0; ok && i<r->nrow; i++ )
+		ok = fwrite( p->dtime[r->row+i] + r->col, sizeof(int), r->ncol, f ) == r->ncol;
+	return ok;
+}
+
+/** Legge da f il rettangolo r di p, scritto da put_rect con times
+ *	retval: 1 se la lettura è riuscita ed il contenuto è valido, 0 altrimenti
+ */
+static int get_rect( FILE *f, planet_t *p, const planet_rect_t *r ){
+	long n = (long)r->nrow * r->ncol;
+	long k;
+	int i, c = 0, ok = 1;
+	bits_t bits;
+	for ( k=0; ok && k<n; k++ ){
+		if ( (k&3) == 0 ) ok = ( c = getc( f ) ) != EOF;
+		bits = GETPOS( (bits_t)c, k&3 );
+		/* la coppia 11 non corrisponde a nessuna cella */
+		ok = ok && bits != 3;
+		if ( ok ) p->w[r->row + k/r->ncol][r->col + k%r->ncol] = bits_to_cell( bits );
+	}
+	ok = ok && ! fseek( f, RECT_CELLS_LEN(n)-BIN_CELLS_LEN(n), SEEK_CUR );
+	for ( i=0; ok && i<r->nrow; i++ )
+		ok = fread( p->btime[r->row+i] + r->col, sizeof(int), r->ncol, f ) == r->ncol;
+	for ( i=0; ok && i<r->nrow; i++ )
+		ok = fread( p->dtime[r->row+i] + r->col, sizeof(int), r->ncol, f ) == r->ncol;
+	return ok;
+}
+
+/* sincronizza e chiude f, il file deve sopravvivere ad un riavvio della macchina */
+static int sync_close( FILE *f, int ok ){
+	ok = ok && ! fflush( f ) && ! fsync( fileno(f) );
+	if ( fclose( f ) ) ok = 0;
+	return ok ? 0 : -1;
+}
+
+int save_wator_bin( const char *file, wator_t *pw, int times, const sim_state_t *state ){
+	planet_bin_hdr_t hdr;
+	planet_t *p = pw->plan;
+	planet_rect_t all;
+	int ok;
+	FILE *f = fopen( file, "w" );
+	if ( ! f ) return -1;
+
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, PLANET_BIN_MAGIC, 4 );
+	/* un checkpoint contiene sempre btime e dtime */
+	if ( state ) times = 1;
+	hdr.flags = ( times ? PLANET_BIN_TIMES : 0 ) | ( state ? PLANET_BIN_STATE : 0 );
+	hdr.nrow = p->nrow;
+	hdr.ncol = p->ncol;
+	hdr.sd = pw->sd;
+	hdr.sb = pw->sb;
+	hdr.fb = pw->fb;
+	ok = fwrite( &hdr, sizeof(hdr), 1, f ) == 1;
+
+	/* l'intero pianeta è un rettangolo: l'intestazione è già allineata, quindi
+	 * il riempimento di put_rect coincide con quello di BIN_TIMES_OFFSET */
+	all.row = all.col = 0;
+	all.nrow = p->nrow;
+	all.ncol = p->ncol;
+	ok = ok && put_rect( f, p, &all, times );
+	if ( ok && state )
+		ok = fwrite( state, sizeof(sim_state_t), 1, f ) == 1;
+	return sync_close( f, ok );
+}
+
+size_t wator_bin_len( unsigned int nrow, unsigned int ncol, int times, int state ){
+	size_t area = (size_t)nrow * ncol;
+	/* vedi save_wator_bin: lo stato implica i tempi */
+	if ( state ) times = 1;
+	return times ? BIN_TIMES_OFFSET(area) + 2*area*sizeof(int) + ( state ? sizeof(sim_state_t) : 0 )
+		: sizeof(planet_bin_hdr_t) + BIN_CELLS_LEN(area);
+}
+
+size_t wator_delta_len( const planet_rect_t rects[], int nrects ){
+	size_t len = sizeof(planet_delta_hdr_t) + sizeof(sim_state_t);
+	int t;
+	for ( t=0; t<nrects; t++ )
+		len += sizeof(planet_rect_t) + RECT_CELLS_LEN( (long)rects[t].nrow*rects[t].ncol )
+			+ 2*sizeof(int)*rects[t].nrow*rects[t].ncol;
+	return len;
+}
+
+int append_wator_delta( const char *file, wator_t *pw, const sim_state_t *state, int base_chronon,
+		const planet_rect_t rects[], int nrects ){
+	planet_delta_hdr_t hdr;
+	int t, ok;
+	FILE *f = fopen( file, "a" );
+	if ( ! f ) return -1;
+
+	memcpy( hdr.magic, PLANET_DELTA_MAGIC, 4 );
+	hdr.base_chronon = base_chronon;
+	hdr.nrects = nrects;
+	hdr.len = wator_delta_len( rects, nrects ) - sizeof(hdr);
+	ok = fwrite( &hdr, sizeof(hdr), 1, f ) == 1
+		&& fwrite( state, sizeof(sim_state_t), 1, f ) == 1;
+	for ( t=0; ok && t<nrects; t++ )
+		ok = fwrite( rects+t, sizeof(planet_rect_t), 1, f ) == 1
+			&& put_rect( f, pw->plan, rects+t, 1 );
+	return sync_close( f, ok );
+}
+
+int replay_wator_deltas( const char *file, wator_t *pw, sim_state_t *state ){
+	planet_delta_hdr_t hdr;
+	planet_rect_t r;
+	sim_state_t st;
+	struct stat fs;
+	long pos = 0;
+	int base = state->chronon, applied = 0, t, ok = 1;
+	FILE *f = fopen( file, "r" );
+	/* nessun delta: il checkpoint è solo la base */
+	if ( ! f ) return ( errno == ENOENT ) ? 0 : -1;
+	if ( fstat( fileno(f), &fs ) ) { fclose( f ); return -1; }
+
+	/* un record troncato ( scrittura interrotta ) chiude la catena */
+	while ( ok && fread( &hdr, sizeof(hdr), 1, f ) == 1 
+	&& ! memcmp( hdr.magic, PLANET_DELTA_MAGIC, 4 ) && pos + sizeof(hdr) + hdr.len <= fs.st_size ){
+		pos += sizeof(hdr) + hdr.len;
+		/* delta di una base precedente, sopravvissuto ad una compattazione interrotta */
+		if ( hdr.base_chronon != base ){
+			ok = ! fseek( f, pos, SEEK_SET );
+			continue;
+		}
+		ok = fread( &st, sizeof(st), 1, f ) == 1;
+		for ( t=0; ok && t<hdr.nrects; t++ )
+			ok = fread( &r, sizeof(r), 1, f ) == 1 && r.row>=0 && r.col>=0 && r.nrow>=0 && r.ncol>=0
+				&& r.row + r.nrow <= pw->plan->nrow && r.col + r.ncol <= pw->plan->ncol
+				&& get_rect( f, pw->plan, &r );
+		if ( ok ){
+			*state = st;
+			applied++;
+		}
+	}
+	fclose( f );
+	if ( ! ok ){
+		errno = ERANGE;
+		return -1;
+	}
+	pw->ns = shark_count( pw->plan );
+	pw->nf = fish_count( pw->plan );
+	return applied;
+}
+
+/* stato di random(), usato al posto di quello interno della libc per poterlo salvare.
+ * Sono due perchè setstate scrive la posizione del generatore nel buffer che abbandona:
+ * il ripristino usa sempre quello non attivo */
+static char rng_state[2][RNG_STATE_LEN];
+static int rng_cur = 0;
+
+void rng_init( unsigned int seed ){
+	initstate( seed, rng_state[rng_cur], RNG_STATE_LEN );
+}
+
+void rng_save( char dest[RNG_STATE_LEN] ){
+	/* setstate memorizza nel buffer attuale la posizione corrente del generatore */
+	setstate( rng_state[rng_cur] );
+	memcpy( dest, rng_state[rng_cur], RNG_STATE_LEN );
+}
+
+void rng_restore( const char src[RNG_STATE_LEN] ){
+	rng_cur = ! rng_cur;
+	memcpy( rng_state[rng_cur], src, RNG_STATE_LEN );
+	/* rilegge dal buffer la posizione del generatore */
+	setstate( rng_state[rng_cur] );
+}
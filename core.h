@@ -7,6 +7,7 @@
 
 #include <pthread.h>
 #include <err.h>
+#include <stdint.h>
 
 #include "wator.h"
 
@@ -30,6 +31,14 @@
  */
 #define MAX_CONNECTIONS (10)
 
+/* dimensioni, indici, offset e campi del protocollo: a 64 bit, poichè l'area di un pianeta
+ * ( e quindi la lunghezza della sua immagine ) supera 2^31 già oltre 46341 x 46341 */
+typedef int64_t wide_t;
+
+/* versione del protocollo wator <-> visualizer: wator la invia con SOCK_CMD_INIT e visualizer
+ * la ripete prima della vista. Dalla versione 2 tutti i campi numerici sono wide_t */
+#define SOCK_PROTOCOL_VERSION (2)
+
 #define WORK_DEF (4)
 #define CHRON_DEF (1)
 
@@ -41,13 +50,32 @@
 
 /* SOCK_CMDS rappresenta il tipo di comando che può essere inviato a visualizer mediante socket*/
 typedef enum {
-	SOCK_CMD_INIT, /* in seguito verranno inviati nrow, ncol */
+	SOCK_CMD_INIT, /* in seguito verranno inviati versione, nrow, ncol; risposta: versione, vista */
 	SOCK_CMD_QUIT, /* chiude la connessione */
 	SOCK_CMD_EXIT, /* termina il processo */
 	SOCK_CMD_SHOW, /* in seguito verrà inviata la matrice: invia <dim><matrice compressa> */
-	SOCK_CMD_SHOW_AND_QUIT /* supponendo la init sia stata precedentemente fatta */
+	SOCK_CMD_SHOW_AND_QUIT, /* supponendo la init sia stata precedentemente fatta */
+	SOCK_CMD_DENSITY_AND_QUIT, /* invia <righe><colonne><conteggi pesci,squali per blocco> */
+	SOCK_CMD_PATCH_AND_QUIT /* invia <n><n sotto matrici r0,c0,nrow,ncol,bits,seq_len,immagine> da applicare all'ultima show */
 }SOCK_CMDS;
 
+/* VIEW_KIND rappresenta la vista del pianeta a cui visualizer si abbona:
+ * visualizer la comunica in risposta a SOCK_CMD_INIT e wator vi si attiene ad ogni show
+ */
+typedef enum {
+	VIEW_FULL, 	/* l'intero pianeta (default) */
+	VIEW_WINDOW, 	/* solo il rettangolo r0,c0 di dimensione nrow x ncol (con wrap toroidale) */
+	VIEW_DENSITY 	/* numero di pesci e squali per ogni blocco block x block */
+}VIEW_KIND;
+
+/* descrizione di una vista: i campi non significativi per kind sono ignorati */
+typedef struct {
+	VIEW_KIND kind;
+	wide_t r0, c0; 	/* angolo in alto a sinistra della finestra */
+	wide_t nrow, ncol; 	/* dimensioni della finestra */
+	wide_t block; 	/* lato dei blocchi della vista a densità */
+} view_t;
+
 /*definizioni per comodità. inutili*/
 typedef int Bool;
 typedef void* Ide ;
@@ -71,12 +99,125 @@ void lock ( Mutex mutex );
  */
 void unlock( Mutex mutex );
 
+/********************************************************************************************************************************* /
+  *
+  *										LOCK TABLE
+  *		Tabella contigua di lock, ognuno su una propria linea di cache.
+  *		Una risorsa ( es. una cella ) non ha un lock proprio ma usa lo slot dato da un hash del suo indice:
+  *		più risorse possono condividere lo slot, per cui chi prende più lock li prende in ordine di slot
+  *		e una sola volta ciascuno ( vedi locktable_lock_all ).
+  *
+/ *********************************************************************************************************************************/
+
+/* dimensione di una linea di cache */
+#define CACHE_LINE (64)
+
+/* tipo dei lock della tabella */
+typedef enum {
+	LOCK_MUTEX,	/* pthread mutex */
+	LOCK_TICKET,	/* spinlock a biglietti: servito nell'ordine di arrivo */
+	LOCK_BYTE	/* byte acquisito con compare and swap: il più economico se non conteso */
+} lock_kind_t;
+
+/* uno slot della tabella */
+typedef union {
+	pthread_mutex_t mutex;
+	struct { unsigned int next, serving; } ticket;
+	unsigned char byte;
+	char pad[CACHE_LINE];
+} __attribute__(( aligned( CACHE_LINE ) )) lock_slot_t;
+
+typedef struct {
+	lock_kind_t kind;
+	size_t nslots; /* potenza di 2 */
+	lock_slot_t *slots;
+} _LockTable;
+/* alias per lettura più agevole ed uso guidato */
+typedef _LockTable* LockTable;
+
+/** crea una tabella di lock
+ *	param nslots: numero di slot, arrotondato alla potenza di 2 successiva
+ *	param kind: tipo dei lock
+ *	retval: la tabella, NULL in caso di errore ( errno settato )
+ */
+LockTable locktable_create( size_t nslots, lock_kind_t kind );
+
+/** distrugge una tabella creata con locktable_create */
+void locktable_destroy( LockTable t );
+
+/** slot della tabella associato alla risorsa di indice index */
+lock_slot_t *locktable_slot( LockTable t, size_t index );
+
+/** prende i lock degli n slot di s, in ordine di indirizzo e senza ripetizioni
+ *	param s: slot da prendere ( riordinati, gli eventuali NULL sono ignorati ); n <= LOCKTABLE_MAX_ALL
+ *	retval: numero di slot distinti presi, che stanno all'inizio di s
+ */
+#define LOCKTABLE_MAX_ALL (16)
+int locktable_lock_all( LockTable t, lock_slot_t *s[], int n );
+
+/** rilascia i primi n slot di s, presi con locktable_lock_all */
+void locktable_unlock_all( LockTable t, lock_slot_t *s[], int n );
+
+/********************************************************************************************************************************* /
+  *
+  *										ARENA
+  *		Zona di memoria anonima riservata in un colpo solo ( mmap ) da cui si prendono oggetti in sequenza.
+  *		Gli oggetti non si liberano uno ad uno: arena_reset li scarta tutti insieme ( la memoria resta
+  *		mappata e viene riusata ), arena_destroy rilascia l'intera zona con una sola munmap.
+  *		La zona è riservata senza impegnare memoria ( MAP_NORESERVE ): il kernel assegna le pagine
+  *		solo quando vengono toccate, per cui conviene sovrastimare la dimensione.
+  *		Il descrittore sta all'inizio della zona stessa.
+  *
+/ *********************************************************************************************************************************/
+
+/* dimensione di una pagina grande */
+#define HUGE_PAGE ( (size_t)2 << 20 )
+
+/* flag di arena_create: prova a mappare l'arena su pagine grandi ( MAP_HUGETLB ),
+ * altrimenti chiede al kernel di usare le transparent huge pages ( MADV_HUGEPAGE ) */
+#define ARENA_HUGE (1)
+
+typedef struct {
+	size_t size; /* byte mappati, descrittore compreso */
+	size_t used; /* byte già assegnati, descrittore compreso */
+	int huge; /* 1 se mappata con MAP_HUGETLB */
+} _Arena;
+/* alias per lettura più agevole ed uso guidato */
+typedef _Arena* Arena;
+
+/** crea un'arena
+ *	param size: byte utilizzabili
+ *	param flags: 0 oppure ARENA_HUGE
+ *	retval: l'arena, NULL in caso di errore ( errno settato )
+ */
+Arena arena_create( size_t size, int flags );
+
+/** crea un'arena mappata sul file file ( creato vuoto e subito eliminato ): come per il pianeta su file
+ *	il kernel può riscrivere su disco ed abbandonare le pagine che non servono, quindi gli oggetti
+ *	presi dall'arena non devono stare tutti in memoria
+ *	param size: byte utilizzabili
+ *	retval: l'arena ( azzerata ), NULL in caso di errore ( errno settato )
+ */
+Arena arena_create_file( const char *file, size_t size );
+
+/** prende size byte dall'arena ( non azzerati se l'arena è stata resettata )
+ *	param align: allineamento richiesto, potenza di 2 ( 0 per quello di malloc )
+ *	retval: puntatore alla memoria, NULL se l'arena è esaurita ( errno = ENOMEM )
+ */
+void *arena_alloc( Arena a, size_t size, size_t align );
+
+/** scarta tutti gli oggetti presi da a: le prossime arena_alloc riusano la stessa memoria */
+void arena_reset( Arena a );
+
+/** rilascia l'arena e tutti gli oggetti presi da essa */
+void arena_destroy( Arena a );
+
 /** valuta la divisione arrotondata per eccesso di num/div
  * param num: numeratore
  * param div: divisore
  * retval : parte intera superiore di num/div
  */
-int top(int num, int div); /* arrotondamento per eccesso */
+wide_t top(wide_t num, wide_t div); /* arrotondamento per eccesso */
 
 /** effettua la printf di v nella forma binaria
  * param v: valore da stampare in bit
@@ -156,6 +297,7 @@ typedef struct node_ {
 typedef struct {
 	Node * head ;
 	Node * tail ;
+	Node * spare ; /* nodi già estratti, riusati dalle enqueue successive */
 } queue_t;
 
 /* e' opportuno che venga maneggiata come ref
@@ -312,7 +454,7 @@ typedef unsigned char bits_t;
  * param dim: numero di elementi di origin
  * retval: numero di bits di buffer
  */
-int compress( bits_t buffer[], cell_t origin[], int dim ); 
+wide_t compress( bits_t buffer[], cell_t origin[], wide_t dim ); 
 
 /** effettua la decompressione della sequenza src,
  *	La sequenza decompressa viene caricata in dest
@@ -321,7 +463,178 @@ int compress( bits_t buffer[], cell_t origin[], int dim );
  * param src_dim: numero di elementi di src
  * retval: lunghezza di dest buffer
  */
-int decompress( cell_t dest[], bits_t src[], int src_dim );
+wide_t decompress( cell_t dest[], bits_t src[], wide_t src_dim );
+
+/** come decompress, ma per una sequenza ricevuta da altri: non scrive mai oltre dest_dim celle
+ * param dest_dim: celle di dest
+ * retval: lunghezza di dest, -1 se src è malformata o si decomprime in più di dest_dim celle
+ */
+wide_t decompress_max( cell_t dest[], wide_t dest_dim, bits_t src[], wide_t src_dim );
+
+
+/********************************************************************************************************************************* /
+  *
+  *										FORMATO BINARIO DEL PIANETA
+  *		< planet_bin_hdr_t >
+  *		< celle: 2 bit per cella (codifica di cell_to_bits), riga per riga, (nrow*ncol+3)/4 byte >
+  *		< riempimento fino a multiplo di sizeof(int) >
+  *		< btime e dtime: nrow*ncol int ciascuna, solo se flags contiene PLANET_BIN_TIMES >
+  *		< sim_state_t, solo se flags contiene PLANET_BIN_STATE (checkpoint, implica PLANET_BIN_TIMES) >
+  *
+/ *********************************************************************************************************************************/
+
+#define PLANET_BIN_MAGIC "WTRB"
+/* il file contiene anche le matrici btime e dtime */
+#define PLANET_BIN_TIMES (1)
+/* il file contiene anche lo stato della simulazione: è un checkpoint */
+#define PLANET_BIN_STATE (2)
+
+/* byte dello stato di random(): 128 corrisponde al generatore usato di default dalla libc */
+#define RNG_STATE_LEN (128)
+
+/* stato della simulazione non contenuto in wator_t, necessario per riprenderla */
+typedef struct {
+	int chronon; /* chronon completati */
+	char rng[RNG_STATE_LEN]; /* stato di random() */
+} sim_state_t;
+
+/* intestazione del formato binario: dimensioni e parametri delle regole */
+typedef struct {
+	char magic[4]; /* PLANET_BIN_MAGIC, senza terminatore */
+	unsigned int flags;
+	unsigned int nrow;
+	unsigned int ncol;
+	int sd;
+	int sb;
+	int fb;
+	int reserved;
+} planet_bin_hdr_t;
+
+/********************************************************************************************************************************* /
+  *
+  *										PIANETA SU FILE (wator.first.c)
+  *
+/ *********************************************************************************************************************************/
+
+/** le matrici dei pianeti creati da qui in poi da new_planet saranno mappate su file invece che allocate
+ *	param file: file di appoggio ( creato se non esiste, il contenuto viene sovrascritto ), NULL per tornare in memoria
+ */
+void set_planet_backing ( const char *file );
+
+/* pagine su cui stanno le matrici di un pianeta in memoria, dalla meno alla più grande */
+typedef enum {
+	PLANET_PAGES_NORMAL,	/* pagine normali ( malloc ) */
+	PLANET_PAGES_THP,	/* transparent huge pages: zona allineata a HUGE_PAGE con MADV_HUGEPAGE */
+	PLANET_PAGES_2M,	/* pagine grandi da 2 MB riservate dall'amministratore ( MAP_HUGETLB ) */
+	PLANET_PAGES_1G	/* pagine grandi da 1 GB riservate dall'amministratore ( MAP_HUGETLB ) */
+} planet_pages_t;
+
+/** le matrici dei pianeti creati da qui in poi da new_planet ( non su file ) staranno
+ *	sulle pagine indicate; se non sono disponibili si ripiega sulle successive più piccole
+ *	param pages: pagine richieste, PLANET_PAGES_NORMAL per tornare alla malloc
+ */
+void set_planet_pages ( planet_pages_t pages );
+
+/** retval: pagine su cui stanno effettivamente le matrici di p */
+planet_pages_t planet_pages ( planet_t *p );
+
+/** crea in mem un pianeta nrow x ncol in memoria ( matrici ad acqua ), come new_planet ma senza allocare:
+ *	mem deve essere di almeno planet_footprint( nrow, ncol ) byte, free_planet non la libera
+ *	retval: il pianeta, NULL ( errno = EINVAL ) se mem è NULL o una dimensione è vuota
+ */
+planet_t * place_planet ( void *mem, unsigned int nrow, unsigned int ncol );
+
+/** byte occupati da un pianeta nrow x ncol creato da new_planet in memoria, descrittori compresi */
+size_t planet_footprint ( unsigned int nrow, unsigned int ncol );
+
+/** retval: 1 se le matrici di p sono mappate su un file di appoggio, 0 altrimenti */
+int planet_backed ( planet_t *p );
+
+/** suggerisce al kernel l'uso delle righe [row, row+nrows) delle tre matrici di p ( vedi madvise )
+ *	Non fa niente se p non è su file
+ *	param advice: consiglio per madvise ( es. MADV_WILLNEED )
+ */
+void planet_advise ( planet_t *p, unsigned int row, unsigned int nrows, int advice );
+
+/** verifica se file è nel formato binario
+ *	param file: path del file
+ *	retval: 1 se inizia con PLANET_BIN_MAGIC, 0 altrimenti (anche se non leggibile)
+ */
+int is_wator_bin( const char *file );
+
+/** crea wator da un file binario: i parametri delle regole sono quelli del file ( wator.conf non viene letto )
+ *	Il file è mappato in memoria e le celle vengono decompresse in parallelo
+ *	param file: path del file
+ *	param state: se non NULL vi viene copiato lo stato della simulazione ( chronon -1 se il file non è un checkpoint )
+ *	retval: wator creato (nwork e chronon a 0), NULL in caso di errore ( errno settato )
+ */
+wator_t* load_wator_bin( const char *file, sim_state_t *state );
+
+/** salva pw nel formato binario. Il file è sincronizzato su disco prima del ritorno
+ *	param file: path del file da creare o sovrascrivere
+ *	param pw: wator da salvare ( regole e pianeta )
+ *	param times: se vero salva anche btime e dtime
+ *	param state: se non NULL salva anche lo stato della simulazione ( e btime e dtime )
+ *	retval: 0 in caso di successo, -1 altrimenti ( errno settato )
+ */
+int save_wator_bin( const char *file, wator_t *pw, int times, const sim_state_t *state );
+
+/** retval: byte del file scritto da save_wator_bin per un pianeta nrow x ncol con gli stessi times e state */
+size_t wator_bin_len( unsigned int nrow, unsigned int ncol, int times, int state );
+
+/* rettangolo di celle del pianeta */
+typedef struct {
+	int row;
+	int col;
+	int nrow;
+	int ncol;
+} planet_rect_t;
+
+/*	Checkpoint incrementali: al checkpoint completo (base) segue un file di delta, ognuno composto da
+ *		< planet_delta_hdr_t >
+ *		< sim_state_t >
+ *		per ogni rettangolo modificato: < planet_rect_t > < celle, riempimento, btime e dtime come nel formato binario >
+ */
+#define PLANET_DELTA_MAGIC "WTRD"
+
+typedef struct {
+	char magic[4]; /* PLANET_DELTA_MAGIC, senza terminatore */
+	int base_chronon; /* chronon della base a cui il delta si applica */
+	unsigned int nrects; /* rettangoli contenuti */
+	unsigned int len; /* byte del delta dopo questa intestazione */
+} planet_delta_hdr_t;
+
+/** aggiunge in fondo al file dei delta i rettangoli rects di pw. Il file è sincronizzato su disco prima del ritorno
+ *	param file: file dei delta ( creato se non esiste )
+ *	param pw: wator da cui prendere le celle
+ *	param state: stato della simulazione al momento del delta
+ *	param base_chronon: chronon della base a cui il delta si applica
+ *	param rects, nrects: rettangoli modificati dopo il checkpoint precedente
+ *	retval: 0 in caso di successo, -1 altrimenti ( errno settato )
+ */
+int append_wator_delta( const char *file, wator_t *pw, const sim_state_t *state, int base_chronon,
+		const planet_rect_t rects[], int nrects );
+
+/** retval: byte aggiunti al file dei delta da append_wator_delta per i rettangoli rects, intestazione compresa */
+size_t wator_delta_len( const planet_rect_t rects[], int nrects );
+
+/** applica a pw, caricato da una base, i delta di file scritti per quella base ( state->chronon ), in ordine
+ *	param file: file dei delta ( se non esiste non ci sono delta )
+ *	param pw: wator caricato dalla base
+ *	param state: stato letto dalla base, sostituito da quello dell'ultimo delta applicato
+ *	retval: numero di delta applicati, -1 in caso di errore ( errno settato )
+ */
+int replay_wator_deltas( const char *file, wator_t *pw, sim_state_t *state );
+
+/** sostituisce lo stato di random() con un buffer interno, inizializzato da seed.
+ *	Con seed 1 la sequenza è quella di default della libc
+ */
+void rng_init( unsigned int seed );
+
+/** copia in dest lo stato di random() ( va chiamata quando nessun thread usa random ) */
+void rng_save( char dest[RNG_STATE_LEN] );
 
+/** ripristina lo stato di random() salvato con rng_save */
+void rng_restore( const char src[RNG_STATE_LEN] );
 
 #endif
@@ -15,16 +15,16 @@ void debug_utils_show_sub_matrix ( sub_planet_t * sub ) {
 	printf("printing subplanet : ( %d x %d ) :\n", sub->_nrow, sub->_ncol );
 	for ( i=0; i<sub->_nrow+2*WEIGHT; i++ ){
 		for ( j=0; j<sub->_ncol+2*WEIGHT; j++ ){
-			real_cell_t * c = & (sub->cell[i][j]);	
+			real_cell_t rc = cell_at( sub, i, j ), *c = &rc;
 			int not_my_area = i<WEIGHT || i>=WEIGHT+sub->_nrow || j<WEIGHT || j>=WEIGHT+sub->_ncol ;
-			int mutex_not_null = c->mutex!=NULL;
+			int mutex_not_null = c->slot!=NULL;
 			
 			if ( mutex_not_null )printf("(");
 			else printf(" ");
 			
 			if ( not_my_area ) printf("\x1b[47m");			
 			
-			if ( *(c->state) != UNKNOWN ) printf("\x1b[41m");
+			if ( STATE_OF( *(c->state) ) != UNKNOWN ) printf("\x1b[41m");
 			
 			switch( * (c->w) ){
 				case WATER :printf ("\x1b[34m" "W" "\x1b[0m" );break;
@@ -44,9 +44,9 @@ void debug_utils_show_sub_matrix ( sub_planet_t * sub ) {
 
 void dump_of_subs( ){
 	#ifdef _SUB_MATRIX_DEBUG_
-	int i;
+	wide_t i;
 	for ( i=0 ; i<num_of_subs ; i++ ){
-		printf("%d ) ",i);
+		printf("%lld ) ",(long long)i);
 		debug_utils_show_sub_matrix( sub_planets+i );				
 	}
 	printf("--- counting : #fish = %d ; #shark = %d \n", ((wator_t*)syc_wator->sharedItem)->nf, ((wator_t*)syc_wator->sharedItem)->ns ); 
@@ -54,8 +54,48 @@ void dump_of_subs( ){
 }
 
 
+/** Riscrive tile_order partendo dalle sotto matrici più costose: le ultime ad esser prese sono le più
+ *	brevi, per cui i worker arrivano alla barriera più o meno insieme.
+ *	Counting sort stabile sul costo ( al più K*N animali ): a parità di costo resta l'ordine di tile_base.
+ *	Va chiamata a chronon concluso, quando nessun worker aggiorna i costi.
+ */
+static void order_by_cost( ){
+	wide_t i, c, pos = 0;
+	for ( c=0; c<=K*N; c++ ) cost_buckets[c] = 0;
+	for ( i=0; i<num_of_subs; i++ ) cost_buckets[ MIN( sub_planets[i].cost, K*N ) ]++;
+	/* posizione della prima sotto matrice di ogni costo, dal più alto */
+	for ( c=K*N; c>=0; c-- ){
+		wide_t n = cost_buckets[c];
+		cost_buckets[c] = pos;
+		pos += n;
+	}
+	for ( i=0; i<num_of_subs; i++ ){
+		wide_t t = tile_base[i];
+		tile_order[ cost_buckets[ MIN( sub_planets[t].cost, K*N ) ]++ ] = t;
+	}
+}
+
+/** Mette nel pool, nell'ordine di tile_order, le sotto matrici attive nella fase in corso: quelle in
+ *	tile_active e, nella seconda fase di owner computes, anche quelle che devono soltanto ricevere arrivi
+ *	( svegliate dai vicini nella prima ). Le altre non hanno animali e nessuno vi entra: restano come sono.
+ *	tiles_dispatched è scritto prima di riempire il pool, così il collector non confronta mai un valore vecchio.
+ */
+static void dispatch_active( ){
+	wide_t i, n = 0;
+	for ( i=0; i<num_of_subs; i++ ){
+		wide_t t = tile_order[i];
+		unsigned long bit = 1UL << ( t%TILE_BITS );
+		if ( ( tile_active[t/TILE_BITS] & bit ) || ( owner_phase == OWNER_APPLY && ( tile_next[t/TILE_BITS] & bit ) ) )
+			tile_batch[n++] = t;
+	}
+	/* almeno una, altrimenti il collector non arriverebbe alla barriera ( aggiornarla non cambia nulla ) */
+	if ( n == 0 ) tile_batch[n++] = tile_order[0];
+	tiles_dispatched = n;
+	for ( i=0; i<n; i++ )
+		sycqueue_enqueue( tile_pool( sub_planets+tile_batch[i] ), sub_planets+tile_batch[i] );
+}
+
 void* main_dispacher( void* args ){
-	int i;
 	Elem END_EVENT_LOOP = 0;
 
 	/* inizializzo i segnali */ 
@@ -66,12 +106,28 @@ void* main_dispacher( void* args ){
 		switch ( (uintptr_t) (sycqueue_dequeue( TO_DISPACHER_QUEUE )) ) {	
 			case EVENT_QUEUE_MSG_DISPACHER_UPDATE:
 				Log("Dispacher <- MSG_UPDATE", DEBUG, NOPERROR);
-				/* metto nel pool le sotto matrici da aggiornare */
+				/* metto nel pool le sotto matrici da aggiornare, nell'ordine scelto in initializer */
 				#ifdef _DEBUG_
 				dump_of_subs( );
 				#endif
-				for ( i=0 ; i<num_of_subs ; i++ )
-					sycqueue_enqueue( sm_pool, sub_planets+i );											
+				/* i worker marcheranno le sotto matrici che modificano con questo chronon */
+				current_chronon++;
+				/* il collector visualizza ogni wat->chronon update: solo allora i worker comprimono */
+				encode_round = fused_encoding && current_chronon % ((wator_t*)syc_wator->sharedItem)->chronon == 0;
+				owner_phase = OWNER_UPDATE;
+				if ( cost_order ) order_by_cost( );
+				{	/* le sotto matrici svegliate nel chronon concluso sono le attive di questo */
+					unsigned long *t = tile_active;
+					tile_active = tile_next;
+					tile_next = memset( t, 0, sizeof( unsigned long )*( num_of_subs/TILE_BITS + 1 ) );
+				}
+				dispatch_active( );
+				break;
+			case EVENT_QUEUE_MSG_DISPACHER_APPLY:
+				Log("Dispacher <- MSG_APPLY", DEBUG, NOPERROR);
+				/* owner computes: le sotto matrici attive hanno riempito gli outbox, ora si applicano gli arrivi */
+				owner_phase = OWNER_APPLY;
+				dispatch_active( );
 				break;
 			case EVENT_QUEUE_MSG_EXIT: 
 				Log("Dispacher <- MSG_EXIT", DEBUG, NOPERROR);
@@ -12,7 +12,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <limits.h>
 #include <string.h>
 #include <wait.h>
 #include <error.h>
@@ -28,11 +36,17 @@
 /* attesa tra un tentativo e l'altro */
 #define DELAY (1)
 /* messaggio da visualizzare in caso sia stato invocato wator in maniera sbagliata */
-#define HELP_MSG "USAGE : wator file [-n nwork] [-v chronon] [-f dumpfile]"
+#define HELP_MSG "USAGE : wator {file | -r checkpoint | -J host:port} [-n nwork] [-a] [-b] [-v chronon] [-f dumpfile] [-p {b|d|a}] [-w r0,c0,nrow,ncol | -d block] [-e] [-z] [-c] [-o | -s] [-L {m|t|b}[,slots]] [-m backingfile] [-H {t|2|1}] [-P nslabs [-T [addr:]port]]"
 
-/* numero di righe e colonne della sub matrix */
+/* numero di righe e colonne della sub matrix
+ *	ridefinibili in compilazione ( es. make wator TFLAGS="-DK=16 -DN=16" ): con sotto matrici più grandi
+ *	la maggior parte delle celle è interna ed è aggiornata senza mutex */
+#ifndef K
 #define K (3)
+#endif
+#ifndef N
 #define N (3)
+#endif
 
 #define MINIMO (3)
 
@@ -42,6 +56,9 @@
 #error "N too SMALL"
 #endif
 
+/* byte massimi dell'immagine compressa di una sotto matrice */
+#define SUB_ENC_LEN (((K*N)+4)>>2)
+
 /* spessore del bordo condiviso! */
 #define WEIGHT (1)
 
@@ -49,8 +66,29 @@
 #define SEC (10)
 /* file su cui fare il dump quando un allarme viene catturato */
 #define WATORCHECK "wator.check"
+/* checkpoint binario completo scritto insieme a WATORCHECK, da cui riprendere con -r */
+#define WATOR_CHECKPOINT "wator.ckpt"
+#define WATOR_CHECKPOINT_TMP "wator.ckpt.tmp"
+/* i checkpoint incrementali sono delta aggiunti al file del checkpoint con questo suffisso */
+#define WATOR_DELTA_SUFFIX ".delta"
+#define WATOR_CHECKPOINT_DELTA WATOR_CHECKPOINT WATOR_DELTA_SUFFIX
+/* suffisso del file, accanto a quello di appoggio del pianeta ( -m ), su cui sta l'arena dei metadati */
+#define WATOR_META_SUFFIX ".meta"
+/* delta dopo i quali si compatta la catena scrivendo un nuovo checkpoint completo */
+#define CKPT_MAX_DELTAS (16)
 
 #define MIN(a,b) (a<b?a:b)
+#define MAX(a,b) (a>b?a:b)
+
+/* socket su cui il coordinatore attende gli slab locali ( -P senza -T ) */
+#define SLAB_SOCK_NAME "./tmp/slab.sck"
+/* socket su cui uno slab locale attende il vicino in alto ( %d è il pid dello slab ) */
+#define SLAB_PEER_SOCK_FMT "./tmp/slab.%d.sck"
+/* lunghezza massima di un indirizzo di slab: path AF_UNIX o host:port */
+#define SLAB_ADDR_LEN (UNIX_PATH_MAX)
+
+/* massimo numero di show saltate consecutivamente dalla politica adattiva */
+#define MAX_SHOW_STRIDE (1024)
 
 /* messaggi che i thread si scambiano mediante le code */
 #define EVENT_QUEUE_MSG_EXIT (0)
@@ -58,6 +96,17 @@
 #define EVENT_QUEUE_MSG_LAST_SHOW (2)
 #define EVENT_QUEUE_MSG_REQUEST_UPDATE (9)
 #define EVENT_QUEUE_MSG_DISPACHER_UPDATE (10)
+#define EVENT_QUEUE_MSG_DISPACHER_APPLY (11)
+
+/* fasi di un chronon nella modalità owner computes ( -o ) */
+#define OWNER_UPDATE (0)
+#define OWNER_APPLY (1)
+
+/* slot della tabella dei lock delle celle condivise, se non indicati con -L */
+#define LOCK_SLOTS_DEF (4096)
+
+/* tentativi speculativi ( -s ) di una sotto matrice prima di aggiornarla acquisendo le versioni */
+#define SPEC_RETRIES (2)
 
 /* stato di una cella : serve ad evitare che un pesce appena nato venga mangiato
  *	in quanto il pasto degli squali avviene prima della nascita dei pesci
@@ -68,41 +117,104 @@ typedef enum{
 	CREATED /* appena creato da procreazione => non può esser mangiato */
 } cell_state_t;
 
+/* stato di una cella del pianeta marcato con il chronon in cui è stato scritto:
+ *	uno stato scritto in un chronon precedente vale UNKNOWN, per cui non va mai ripulito */
+typedef unsigned int cell_mark_t;
+/* marca lo stato s con il chronon in corso */
+#define STATE_MARK(s) ( ( (unsigned int)current_chronon << 2 ) | (s) )
+/* stato rappresentato dalla marca m nel chronon in corso */
+#define STATE_OF(m) ( ( (m) >> 2 ) == ( (unsigned int)current_chronon & ( UINT_MAX >> 2 ) ) ? (cell_state_t)( (m) & 3 ) : UNKNOWN )
+
 /*	Reale descrizione di una cella di una sotto matrice che fa riferimento ad una cella reale
+ *	Non è memorizzata: è calcolata al volo da cell_at a partire dall'origine della sotto matrice
  *	Gli indici i e j indicano la posizione della cella all'interno del pianeta
  *	Il valore di w è un riferimento a quello della cella, per comodità
- *	La mutex serve a garantire che un solo worker operi sulla cella
+ *	Lo slot della tabella di lock serve a garantire che un solo worker operi sulla cella ( NULL se non condivisa )
  *	Lo stato definisce come un essere limitrofe si deve comportare nei confronti di quello contenuto qua
- *	Trascino una copia della referenza a wator per comodità
+ *	Nella modalità speculativa le celle condivise sono protette da un numero di versione invece che dal lock
  */
 typedef struct { 
 	int i, j;
 	cell_t * w;
-	Mutex mutex;
-	cell_state_t *state;
-	wator_t *pw;
+	lock_slot_t *slot;
+	cell_mark_t *state;
+	unsigned int *version;
 } real_cell_t;
 
-/* Sotto matrice: ne sono definite le dimensioni
- *	e una matrice di real_cell_t con l'aggiunta dei bordi (area raggiungibile da un
- *	essere in questa sotto matrice, che risiede in un'altra sotto matrice)
+/*	Animale che nella modalità owner computes lascia la propria sotto matrice:
+ *	la sotto matrice che possiede la cella di arrivo decide se accettarlo.
+ *	Se si è spostato, la cella di partenza resta occupata finchè non si conosce l'esito
+ */
+typedef struct {
+	int i, j; /* cella di arrivo nel pianeta */
+	int oi, oj; /* cella di partenza nel pianeta */
+	cell_t cell;
+	int btime, dtime;
+	int moved; /* 1 se l'animale si è spostato, 0 se è appena nato */
+} ghost_move_t;
+
+/* Sotto matrice: è descritta dalla sola origine e dalle dimensioni,
+ *	le sue celle e quelle della cornice (area raggiungibile da un essere in questa sotto matrice,
+ *	che risiede in un'altra sotto matrice) sono calcolate al volo da cell_at
  */ 
 typedef struct {
 	int _nrow, _ncol; /* potrebbero esser minori di n, k*/
-	real_cell_t	cell[K+2*WEIGHT][N+2*WEIGHT]; /* per comodità metto la cornice */	
+	int _row, _col; /* origine della sotto matrice nel pianeta */
+	int stamp; /* ultimo chronon in cui una cella della sotto matrice è cambiata */
+	int touched; /* ultimo chronon in cui il worker ha aggiornato un animale (anche solo btime o dtime) */
+	bits_t enc[SUB_ENC_LEN]; /* immagine compressa prodotta dal worker (codifica fusa) */
+	int enc_bits; /* lunghezza di enc in bits */
+	int enc_valid; /* vero se enc corrisponde ancora al contenuto della sotto matrice */
+	/* owner computes e speculativo: copia privata della sotto matrice con la cornice */
+	planet_t *ghost;
+	/* owner computes: animali usciti verso ciascun vicino ( NORD, SUD, OVEST, EST ), NULL nelle altre modalità */
+	ghost_move_t (*out)[MAX(K,N)];
+	int nout[4];
+	/* owner computes: pesci e squali presenti nella sotto matrice */
+	int nf, ns;
+	/* animali aggiornati nell'ultimo chronon: stima del lavoro della sotto matrice ( -c ) */
+	int cost;
 } sub_planet_t;
 
+/*	Politica con cui il collector consegna i frame a visualizer:
+ *	se visualizer è più lento della simulazione, solo SHOW_POLICY_BLOCK rallenta i chronon
+ */
+typedef enum {
+	SHOW_POLICY_BLOCK, 	/* il collector attende che il frame sia stato inviato (default) */
+	SHOW_POLICY_DROP, 	/* un frame non ancora inviato viene sostituito dal più recente */
+	SHOW_POLICY_ADAPTIVE 	/* se visualizer è in ritardo le show vengono diradate */
+} show_policy_t;
+
+/* contatori dei frame: prodotti dalla simulazione, inviati a visualizer, scartati */
+typedef struct {
+	unsigned long produced, sent, dropped;
+} show_stats_t;
+
+/* contatori della modalità speculativa: aggiornamenti pubblicati, annullati e fatti acquisendo le versioni */
+typedef struct {
+	unsigned long commits, aborts, fallbacks;
+} spec_stats_t;
+
 /*	Un worker_i è definito da:
  *		Il thread che lo concretizza
  *		Un indice nell'array dei worker del dispacer
+ *		Le variazioni del numero di pesci e squali nel chronon in corso, sommate dal collector
+ *		ai contatori di wator alla fine di ogni chronon
+ *	Occupa una linea di cache a sè, così che i contatori di due worker non si contendano la stessa linea
  */
 typedef struct {
 	pthread_t thread;
 	int wid;
-} worker_t;
+	int dnf, dns;
+	Arena scratch; /* memoria di lavoro della sotto matrice in corso */
+	SycQueue pool; /* sotto matrici da aggiornare: la propria fascia con -b, sm_pool altrimenti */
+} __attribute__(( aligned( CACHE_LINE ) )) worker_t;
 
-/*	Mutua esclusione nella modifica dei contatori realizzata mediante
- *	un syccont. sarebbe sufficiente una mutex 
+/* dimensione della memoria di lavoro di un worker: stati, versioni lette e loro valori
+ * di una sotto matrice con la cornice ( modalità owner computes e speculativa ) */
+#define SCRATCH_SIZE ( (size_t)(K+2*WEIGHT)*(N+2*WEIGHT)*( sizeof(cell_state_t) + sizeof(unsigned int*) + sizeof(unsigned int) ) + 4*CACHE_LINE )
+
+/*	Contenitore di wator: i contatori sono modificati solo dal collector, a chronon concluso
  */
 SycCont syc_wator;
 
@@ -119,15 +231,63 @@ SycQueue sm_pool;
 /* array di sottopianeti da inizializzare */
 sub_planet_t * sub_planets;
 /* dimensione del precedente array */
-int num_of_subs;
+wide_t num_of_subs;
+/* numero di sotto matrici per riga del pianeta */
+wide_t subs_per_row;
+/* ordine in cui il dispacher mette le sotto matrici nel pool: indici in sub_planets */
+wide_t *tile_order;
+/* ordine di base, per righe o lungo la curva di Morton: coincide con tile_order se non si ordina per costo */
+wide_t *tile_base;
+/* vero se le sotto matrici sono aggiornate lungo la curva di Morton ( -z ) invece che per righe */
+int morton_order;
+/* vero se ad ogni chronon le sotto matrici partono dalla più costosa ( -c ) */
+int cost_order;
+/* appoggio dell'ordinamento per costo: un contatore per ogni costo da 0 a K*N */
+wide_t *cost_buckets;
+/* bit per parola delle mappe di attività */
+#define TILE_BITS ( 8*sizeof(unsigned long) )
+/* mappe di attività, un bit per sotto matrice: il dispacher mette nel pool solo quelle attive
+ * nel chronon in corso ( tile_active ), i worker segnano in tile_next quelle da aggiornare nel prossimo */
+unsigned long *tile_active, *tile_next;
+/* sotto matrici attive, nell'ordine di tile_order, messe nel pool nella fase in corso */
+wide_t *tile_batch;
+/* quante sono: il collector raggiunge la barriera quando le ha ricevute tutte */
+wide_t tiles_dispatched;
+/* chronon in corso: incrementato dal dispacher all'avvio di ogni update */
+int current_chronon;
+/* vero se i worker comprimono la propria sotto matrice subito dopo averla aggiornata */
+int fused_encoding;
+/* vero se il chronon in corso verrà visualizzato (settato dal dispacher) */
+int encode_round;
+/* vero se ogni sotto matrice scrive solo nella propria area ( -o ): niente mutex sui bordi */
+int owner_computes;
+/* fase del chronon in corso nella modalità owner computes (settata dal dispacher) */
+int owner_phase;
+/* vero se i worker aggiornano le sotto matrici in modo speculativo ( -s ) invece che con le mutex */
+int speculative;
+/* contatori della modalità speculativa, aggiornati dai worker */
+spec_stats_t spec_stats;
+/* vero se ogni worker gira sempre sulla stessa cpu ( -a ) */
+int pin_workers;
+/* vero se ogni worker aggiorna sempre la stessa fascia di righe di sotto matrici ( -b ),
+ * le cui pagine sono portate sul suo nodo NUMA */
+int worker_bands;
 
 /* array di worker. la dimensione è nwork */
 worker_t * workers;
 
-/* coda di elementi allocati in inizializer di D_T da deallocare al termine di esso */
-Queue toFree;
-/* coda di real_cell_t di cui va resettato lo stato che risiedono in aree condivise */
-SycQueue toClean;
+/* lock delle celle condivise: tipo e numero di slot scelti con -L */
+LockTable cell_locks;
+
+/* stati delle celle del pianeta marcati con il chronon, linearizzati */
+cell_mark_t *cell_states;
+/* versioni delle celle del pianeta ( modalità speculativa, NULL altrimenti ), linearizzate */
+unsigned int *cell_versions;
+
+/* arena delle strutture create in initializer che vivono fino alla destroy ( rilasciate insieme ) */
+Arena run_arena;
+/* file di appoggio del pianeta ( -m ), NULL se il pianeta è in memoria */
+char *planet_file;
 
 /***************************************************************************************/
 
@@ -145,6 +305,32 @@ void setSignals();
  */
 void* main_worker( void* args );
 
+/*
+ *	Descrive la cella (I,J) della sotto matrice sub: gli indici partono da 0 sulla cornice
+ */
+real_cell_t cell_at( sub_planet_t *sub, int I, int J );
+
+/*
+ *	Vero se la cella (i,j) del pianeta p è condivisa tra più sotto matrici ( ha un lock )
+ */
+int shared_cell( planet_t *p, wide_t i, wide_t j );
+
+/*
+ *	Coda da cui il worker che aggiorna sub la prende: quella del proprietario della fascia con -b, sm_pool altrimenti
+ */
+SycQueue tile_pool( sub_planet_t *sub );
+
+/*
+ *	Segna la sotto matrice di indice t da aggiornare nel prossimo chronon
+ */
+void wake_tile( wide_t t );
+
+/*
+ *	Comprime la sotto matrice sub (senza cornice) del pianeta in dest
+ *	dest deve avere almeno SUB_ENC_LEN byte. retval: lunghezza in bits
+ */
+int encode_sub( sub_planet_t *sub, bits_t *dest );
+
 /*
  *	DISPACHER
  */
@@ -175,11 +361,59 @@ void closeVisualizer( );
 /*
  *	Funzione che comunica a visualizer che la matrice ha dimensione nrow x ncol 
  */
-void visualizer_init( int nrow, int ncol );
+void visualizer_init( wide_t nrow, wide_t ncol );
 
 /*
  *	Funzione che data una matrice la invia al visualizer
  */
-void show(cell_t*w, int nrow, int ncol);
+void show(cell_t*w, wide_t nrow, wide_t ncol);
+
+/*
+ *	Avvia il thread che invia i frame a visualizer secondo la politica data
+ *	(con SHOW_POLICY_BLOCK non viene creato nessun thread)
+ */
+void show_setup( show_policy_t policy );
+
+/*
+ *	Consegna un'immagine della matrice a visualizer applicando la politica scelta.
+ *	Se last è vero il frame non viene mai scartato e la funzione ritorna solo dopo l'invio
+ */
+void show_frame( cell_t*w, wide_t nrow, wide_t ncol, int last );
+
+/*
+ *	Termina il thread di invio dei frame e ritorna i contatori
+ */
+show_stats_t show_teardown( );
+
+/*
+ *	SLAB (simulazione divisa tra processi, vedi slab.c)
+ */
+
+/*
+ *	Divide il pianeta di wat in nslabs strisce e le consegna ad altrettanti processi slab.
+ *	Con addr NULL gli slab sono creati qui e comunicano in AF_UNIX, altrimenti si attende su addr
+ *	( host:port ) che nslabs processi avviati con wator -J si connettano
+ */
+void slab_start( wator_t *wat, int nslabs, const char *addr );
+
+/*
+ *	Esegue un chronon su tutte le strisce ed aggiorna i contatori di wat
+ */
+void slab_step( wator_t *wat );
+
+/*
+ *	Ricompone in wat il pianeta delle strisce: se times è vero anche btime e dtime
+ */
+void slab_gather( wator_t *wat, int times );
+
+/*
+ *	Termina gli slab
+ */
+void slab_stop( );
+
+/*
+ *	Processo slab: si connette al coordinatore in addr e ne esegue i comandi fino alla terminazione
+ */
+void slab_main( const char *addr );
 
 #endif
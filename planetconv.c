@@ -0,0 +1,41 @@
+/** \file planetconv.c
+	\author Mattia Villani
+	Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+	originale dell' autore.  */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+/* formato binario e logging */
+#include "core.h"
+
+#define CONV_HELP_MSG "USAGE : planetconv [-t] [-x] in out\n\t(default) testo -> binario, regole lette da wator.conf\n\t-t binario -> testo\n\t-x salva anche btime e dtime (solo verso binario)\n"
+
+/** Converte un pianeta tra il formato testuale e quello binario ( vedi core.h ) */
+int main(int argc, char** argv ){
+	/* verso di conversione e salvataggio di btime e dtime */
+	int to_text = 0, times = 0;
+	int opt;
+	wator_t *wat;
+	FILE *out;
+
+	while ((opt = getopt(argc, argv, "tx")) != -1)
+		switch (opt){
+			case 't': to_text = 1; break;
+			case 'x': times = 1; break;
+			default: fprintf(stderr, CONV_HELP_MSG); exit(EXIT_FAILURE); break;
+		}
+	if ( argc - optind != 2 ) { fprintf(stderr, CONV_HELP_MSG); exit(EXIT_FAILURE); }
+
+	if ( to_text ){
+		wat = testNull( load_wator_bin( argv[optind], NULL ), argv[optind], PERROR );
+		out = testNull( fopen( argv[optind+1], "w" ), argv[optind+1], PERROR );
+		testMinus( print_planet( out, wat->plan ), "print_planet", PERROR );
+		fclose( out );
+	}else{
+		/* new_wator legge anche wator.conf, da cui vengono prese le regole */
+		wat = testNull( new_wator( argv[optind] ), argv[optind], PERROR );
+		testMinus( save_wator_bin( argv[optind+1], wat, times, NULL ), argv[optind+1], PERROR );
+	}
+	free_wator( wat );
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,635 @@
+/** \file slab.c
+	\author Mattia Villani
+	Si dichiara che il contenuto di questo file e' in ogni sua parte opera
+	originale dell' autore.  */
+#include "main_header.h"
+
+/********************************************************************************************************************************* /
+  *
+  *										SIMULAZIONE DIVISA TRA PROCESSI ( -P )
+  *		Il pianeta è diviso in strisce orizzontali di righe consecutive, ognuna aggiornata da un processo
+  *		(slab) con le regole di wator.first.c. Lo slab tiene la propria striscia in un pianeta locale con
+  *		una riga in più sopra ed una sotto (alone), copie delle righe di confine delle strisce vicine.
+  *		Le colonne non sono divise: il toro in orizzontale è quello del pianeta locale, in verticale è
+  *		dato dal giro delle strisce (il vicino in basso dello slab i è lo slab i+1, dell'ultimo il primo).
+  *		Ad ogni chronon:
+  *			1) gli slab si scambiano le righe di confine, che diventano gli aloni dei vicini
+  *			2) ogni slab aggiorna le proprie righe: un animale può muoversi, nascere o mangiare nell'alone
+  *			3) le celle dell'alone cambiate sono inviate al vicino come arrivi: il vicino, dopo il proprio
+  *			   aggiornamento, li accetta se la cella è libera ( uno squalo anche se c'è un pesce, che mangia )
+  *			4) il vicino risponde quali arrivi ha respinto: un animale respinto resta nella cella da cui è
+  *			   partito, che fino alla risposta è occupata da uno squalo fittizio; un figlio respinto non nasce
+  *		Il coordinatore (il processo wator avviato dall'utente) distribuisce le strisce, comanda i
+  *		chronon, somma i contatori e ricompone il pianeta per visualizer e per i checkpoint.
+  *		Le connessioni sono AF_UNIX, con gli slab creati dal coordinatore, oppure TCP ( -T [addr:]port ), con gli slab
+  *		avviati dall'utente su qualsiasi macchina ( wator -J host:port ). I dati viaggiano nella
+  *		rappresentazione della macchina: le macchine devono essere omogenee.
+  *
+/ *********************************************************************************************************************************/
+
+/* comandi dal coordinatore agli slab */
+typedef enum {
+	SLAB_CMD_STEP, 	/* esegui un chronon, risposta: pesci e squali della striscia */
+	SLAB_CMD_SHOW, 	/* risposta: immagine compressa della striscia */
+	SLAB_CMD_STATE, 	/* risposta: celle, btime e dtime della striscia */
+	SLAB_CMD_EXIT 	/* termina */
+} slab_cmd_t;
+
+/* descrizione della striscia inviata dal coordinatore, seguita da celle, btime e dtime delle sue righe */
+typedef struct {
+	int index, nslabs;
+	int sd, sb, fb;
+	unsigned int nrow, ncol; /* dimensioni del pianeta */
+	unsigned int row0, nrows; /* prima riga e numero di righe della striscia */
+	char down[SLAB_ADDR_LEN]; /* indirizzo dello slab vicino in basso */
+} slab_setup_t;
+
+/* animale arrivato nell'alone, da consegnare al vicino */
+typedef struct {
+	int col;
+	cell_t cell;
+	int btime, dtime;
+	int moved; /* 1 se si è spostato dalla striscia ( e la cella di partenza attende la risposta ), 0 se è nato */
+} slab_move_t;
+
+/* direzioni dei vicini: indici di peer e degli array per vicino */
+#define SLAB_UP (0)
+#define SLAB_DOWN (1)
+
+/** Scrive esattamente len byte su fd ( FATAL se la connessione si interrompe ) */
+static void send_all( int fd, const void *buf, size_t len ){
+	const char *p = buf;
+	while ( len > 0 ){
+		ssize_t n = write( fd, p, len );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) Log("Slab connection (write)", FATAL, PERROR);
+		p += n;
+		len -= n;
+	}
+}
+
+/** Legge esattamente len byte da fd ( FATAL se la connessione si interrompe ) */
+static void recv_all( int fd, void *buf, size_t len ){
+	char *p = buf;
+	while ( len > 0 ){
+		ssize_t n = read( fd, p, len );
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) Log("Slab connection (read)", FATAL, PERROR);
+		if ( n == 0 ) Log("Slab connection closed", FATAL, NOPERROR);
+		p += n;
+		len -= n;
+	}
+}
+
+/** Traduce un indirizzo: "host:port" è TCP ( host vuoto: la macchina locale, anche per la bind:
+ *	gli slab non autenticano i pari, per ascoltare su altre interfacce vanno indicate ),
+ *	altrimenti è il path di un socket AF_UNIX
+ *	retval: lunghezza dell'indirizzo scritto in sa
+ */
+static socklen_t slab_sockaddr( const char *addr, struct sockaddr_storage *sa ){
+	const char *colon = strrchr( addr, ':' );
+	memset( sa, 0, sizeof(*sa) );
+	if ( ! colon ){
+		struct sockaddr_un *un = (struct sockaddr_un*) sa;
+		un->sun_family = AF_UNIX;
+		strncpy( un->sun_path, addr, UNIX_PATH_MAX-1 );
+		return sizeof(struct sockaddr_un);
+	}else{
+		struct addrinfo hints, *res;
+		char host[SLAB_ADDR_LEN];
+		socklen_t len;
+		snprintf( host, sizeof(host), "%.*s", (int)(colon-addr), addr );
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if ( getaddrinfo( host[0] ? host : NULL, colon+1, &hints, &res ) )
+			Log( addr, FATAL, NOPERROR );
+		memcpy( sa, res->ai_addr, len = res->ai_addrlen );
+		freeaddrinfo( res );
+		return len;
+	}
+}
+
+/** Crea un socket in ascolto su addr (vedi slab_sockaddr) */
+static int slab_listen( const char *addr ){
+	struct sockaddr_storage sa;
+	socklen_t len = slab_sockaddr( addr, &sa );
+	int fd, one = 1;
+	testMinus( fd = socket( sa.ss_family, SOCK_STREAM, 0 ), "Slab socket", PERROR );
+	/* elimino un eventuale vecchio socket rimasto per sbaglio */
+	if ( sa.ss_family == AF_UNIX ) unlink( addr );
+	else setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+	testMinus( bind( fd, (struct sockaddr*) &sa, len ), addr, PERROR );
+	testMinus( listen( fd, SOMAXCONN ), "Slab listen", PERROR );
+	return fd;
+}
+
+/** Si connette ad addr, riprovando come create_connection finché l'altro lato non è pronto */
+static int slab_connect( const char *addr ){
+	struct sockaddr_storage sa;
+	socklen_t len = slab_sockaddr( addr, &sa );
+	int i, fd, one = 1;
+	for ( i=0; i<NUM_OF_TRIAL; i++ ){
+		testMinus( fd = socket( sa.ss_family, SOCK_STREAM, 0 ), "Slab socket", PERROR );
+		if ( connect( fd, (struct sockaddr*) &sa, len ) != -1 ){
+			/* messaggi brevi ad ogni chronon: niente attese dell'algoritmo di Nagle */
+			if ( sa.ss_family != AF_UNIX ) setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+			return fd;
+		}
+		if ( errno != ENOENT && errno != ECONNREFUSED && errno != EINTR ) Log( addr, FATAL, PERROR );
+		/* dopo una connect fallita il socket non è riutilizzabile */
+		close( fd );
+		sleep( DELAY );
+	}
+	Log("Slab connection: max num of hit reached", FATAL, NOPERROR);
+	return -1; /* non raggiungibile */
+}
+
+/** Accetta una connessione su lfd */
+static int slab_accept( int lfd ){
+	int fd, one = 1;
+	while ( ( fd = accept( lfd, NULL, NULL ) ) < 0 )
+		if ( errno != EINTR ) Log("Slab accept", FATAL, PERROR);
+	/* fallisce senza danni su AF_UNIX */
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+	/* visualizer non deve ereditare le connessioni del coordinatore, o gli slab non ne vedrebbero la chiusura */
+	testMinus( fcntl( fd, F_SETFD, FD_CLOEXEC ), "Slab fcntl", PERROR );
+	return fd;
+}
+
+/********************************************************************************************************************************* /
+  *
+  *										COORDINATORE
+  *
+/ *********************************************************************************************************************************/
+
+/* numero di slab, connessioni con essi e strisce assegnate, in ordine di striscia */
+static int nslab = 0;
+static int *slab_fd;
+static unsigned int *slab_row0, *slab_rows;
+/* processi slab creati dal coordinatore ( solo AF_UNIX ) */
+static pid_t *slab_pid;
+
+void slab_start( wator_t *wat, int nslabs, const char *addr ){
+	planet_t *p = wat->plan;
+	char (*peer_addr)[SLAB_ADDR_LEN];
+	int i, lfd;
+	if ( nslabs < 1 || nslabs > p->nrow ) Log("Slabs must be between 1 and the planet rows", FATAL, NOPERROR);
+	nslab = nslabs;
+	slab_fd = testedMalloc( sizeof(int)*nslab );
+	slab_row0 = testedMalloc( sizeof(unsigned int)*nslab );
+	slab_rows = testedMalloc( sizeof(unsigned int)*nslab );
+	slab_pid = testedMalloc( sizeof(pid_t)*nslab );
+	peer_addr = testedMalloc( SLAB_ADDR_LEN*nslab );
+	memset( slab_pid, 0, sizeof(pid_t)*nslab );
+
+	lfd = slab_listen( addr ? addr : SLAB_SOCK_NAME );
+	if ( ! addr )
+		/* slab locali: sono processi figli che si connettono al socket appena creato */
+		for ( i=0; i<nslab; i++ ){
+			testMinus( slab_pid[i] = fork(), "Can't Fork", PERROR );
+			if ( slab_pid[i] == 0 ){
+				close( lfd );
+				slab_main( SLAB_SOCK_NAME );
+				_exit( EXIT_SUCCESS );
+			}
+		}
+	else
+		Log("Waiting for the slabs ( wator -J host:port )", DEBUG, NOPERROR);
+
+	/* le strisce sono assegnate in ordine di connessione; ogni slab comunica dove attende il vicino in alto */
+	for ( i=0; i<nslab; i++ ){
+		slab_fd[i] = slab_accept( lfd );
+		recv_all( slab_fd[i], peer_addr[i], SLAB_ADDR_LEN );
+		peer_addr[i][SLAB_ADDR_LEN-1] = '\0';
+		if ( peer_addr[i][0] == ':' ){
+			/* uno slab TCP comunica solo la porta: l'host è quello da cui si è connesso */
+			struct sockaddr_in peer;
+			socklen_t len = sizeof(peer);
+			/* ":" seguito da al più 5 cifre */
+			char host[INET_ADDRSTRLEN], port[8];
+			testMinus( getpeername( slab_fd[i], (struct sockaddr*) &peer, &len ), "Slab peer name", PERROR );
+			inet_ntop( AF_INET, &peer.sin_addr, host, sizeof(host) );
+			strncpy( port, peer_addr[i], sizeof(port)-1 );
+			port[sizeof(port)-1] = '\0';
+			snprintf( peer_addr[i], SLAB_ADDR_LEN, "%s%s", host, port );
+		}
+	}
+	close( lfd );
+	if ( ! addr ) unlink( SLAB_SOCK_NAME );
+
+	/* consegno ad ogni slab la sua striscia ed il vicino a cui connettersi */
+	for ( i=0; i<nslab; i++ ){
+		slab_setup_t s;
+		size_t area;
+		memset( &s, 0, sizeof(s) );
+		s.index = i;
+		s.nslabs = nslab;
+		s.sd = wat->sd;
+		s.sb = wat->sb;
+		s.fb = wat->fb;
+		s.nrow = p->nrow;
+		s.ncol = p->ncol;
+		s.row0 = slab_row0[i] = (unsigned int) ( (uint64_t) p->nrow*i/nslab );
+		s.nrows = slab_rows[i] = (unsigned int) ( (uint64_t) p->nrow*(i+1)/nslab ) - s.row0;
+		strcpy( s.down, peer_addr[ (i+1)%nslab ] );
+		area = (size_t) s.nrows*p->ncol;
+		send_all( slab_fd[i], &s, sizeof(s) );
+		/* le matrici del pianeta sono contigue: le righe della striscia sono un unico blocco */
+		send_all( slab_fd[i], p->w[s.row0], area*sizeof(cell_t) );
+		send_all( slab_fd[i], p->btime[s.row0], area*sizeof(int) );
+		send_all( slab_fd[i], p->dtime[s.row0], area*sizeof(int) );
+	}
+	free( peer_addr );
+	Log("Slabs started", DEBUG, NOPERROR);
+}
+
+/** Invia cmd a tutti gli slab */
+static void slab_broadcast( slab_cmd_t cmd ){
+	int i;
+	for ( i=0; i<nslab; i++ ) send_all( slab_fd[i], &cmd, sizeof(cmd) );
+}
+
+void slab_step( wator_t *wat ){
+	int i, cnt[2];
+	slab_broadcast( SLAB_CMD_STEP );
+	/* la risposta arriva quando lo slab ha concluso anche gli scambi con i vicini */
+	wat->nf = wat->ns = 0;
+	for ( i=0; i<nslab; i++ ){
+		recv_all( slab_fd[i], cnt, sizeof(cnt) );
+		wat->nf += cnt[0];
+		wat->ns += cnt[1];
+	}
+}
+
+void slab_gather( wator_t *wat, int times ){
+	planet_t *p = wat->plan;
+	int i;
+	slab_broadcast( times ? SLAB_CMD_STATE : SLAB_CMD_SHOW );
+	for ( i=0; i<nslab; i++ ){
+		size_t area = (size_t) slab_rows[i]*p->ncol;
+		if ( times ){
+			recv_all( slab_fd[i], p->w[slab_row0[i]], area*sizeof(cell_t) );
+			recv_all( slab_fd[i], p->btime[slab_row0[i]], area*sizeof(int) );
+			recv_all( slab_fd[i], p->dtime[slab_row0[i]], area*sizeof(int) );
+		}else{
+			/* per la sola visualizzazione basta l'immagine compressa delle celle */
+			wide_t bits_len;
+			bits_t *buff;
+			recv_all( slab_fd[i], &bits_len, sizeof(wide_t) );
+			/* lo slab comprime in un buffer da (area+4)/4 byte e deve ridare esattamente area celle */
+			if ( bits_len < 0 || top( bits_len, 4 ) > (wide_t) ( ( area+4 ) >> 2 ) )
+				Log("Slab sent a bad image", FATAL, NOPERROR);
+			buff = testedMalloc( top( bits_len, 4 ) );
+			recv_all( slab_fd[i], buff, top( bits_len, 4 ) );
+			if ( decompress_max( p->w[slab_row0[i]], area, buff, bits_len ) != (wide_t) area )
+				Log("Slab sent a bad image", FATAL, NOPERROR);
+			free( buff );
+		}
+	}
+}
+
+void slab_stop( ){
+	int i;
+	slab_broadcast( SLAB_CMD_EXIT );
+	for ( i=0; i<nslab; i++ ){
+		close( slab_fd[i] );
+		if ( slab_pid[i] ) waitpid( slab_pid[i], NULL, 0 );
+	}
+	free( slab_fd );
+	free( slab_row0 );
+	free( slab_rows );
+	free( slab_pid );
+	nslab = 0;
+}
+
+/********************************************************************************************************************************* /
+  *
+  *										SLAB
+  *
+/ *********************************************************************************************************************************/
+
+/* striscia locale: righe 1..h, con gli aloni nelle righe 0 e h+1 */
+static wator_t *local;
+/* connessioni con i vicini */
+static int peer[2];
+/* stato delle celle nel chronon in corso ( vedi cell_state_t ), per tutte le h+2 righe */
+static cell_state_t *local_state;
+/* aloni come ricevuti dai vicini, prima dell'aggiornamento */
+static cell_t *halo[2];
+/* per colonna dell'alone: vero se un animale della striscia vi si è spostato */
+static char *moved[2];
+/* arrivi da inviare e ricevuti, con le relative risposte ( 1 accettato, 0 respinto ) */
+static slab_move_t *out_moves[2], *in_moves[2];
+static char *out_acks[2], *in_acks[2];
+/* buffer dell'immagine compressa per SLAB_CMD_SHOW */
+static bits_t *show_buff;
+
+/** Invia out[d] e riceve in[d] da entrambi i vicini contemporaneamente ( d = SLAB_UP, SLAB_DOWN ).
+ *	Le scritture non possono attendere le letture: due vicini che si inviano righe più grandi
+ *	del buffer del socket si bloccherebbero a vicenda
+ */
+static void exchange( const void *out[2], size_t out_len[2], void *in[2], size_t in_len[2] ){
+	size_t sent[2] = { 0, 0 }, got[2] = { 0, 0 };
+	struct pollfd pfd[2];
+	int d;
+	while ( sent[0]<out_len[0] || sent[1]<out_len[1] || got[0]<in_len[0] || got[1]<in_len[1] ){
+		for ( d=0; d<2; d++ ){
+			pfd[d].events = ( sent[d] < out_len[d] ? POLLOUT : 0 ) | ( got[d] < in_len[d] ? POLLIN : 0 );
+			/* un vicino con cui ho concluso potrebbe aver già chiuso: non lo controllo più */
+			pfd[d].fd = pfd[d].events ? peer[d] : -1;
+		}
+		if ( poll( pfd, 2, -1 ) < 0 ){
+			if ( errno == EINTR ) continue;
+			Log("Slab poll", FATAL, PERROR);
+		}
+		for ( d=0; d<2; d++ ){
+			ssize_t n;
+			if ( pfd[d].revents & POLLOUT ){
+				n = write( peer[d], (const char*) out[d] + sent[d], out_len[d] - sent[d] );
+				if ( n < 0 && errno != EAGAIN && errno != EINTR ) Log("Slab neighbour (write)", FATAL, PERROR);
+				if ( n > 0 ) sent[d] += n;
+			}
+			if ( pfd[d].revents & ( POLLIN | POLLHUP | POLLERR ) ){
+				n = read( peer[d], (char*) in[d] + got[d], in_len[d] - got[d] );
+				if ( n == 0 ) Log("Slab neighbour closed", FATAL, NOPERROR);
+				if ( n < 0 && errno != EAGAIN && errno != EINTR ) Log("Slab neighbour (read)", FATAL, PERROR);
+				if ( n > 0 ) got[d] += n;
+			}
+		}
+	}
+}
+
+/** Riga della striscia adiacente all'alone d ( dove arrivano gli animali del vicino d ) */
+static unsigned int border_row( int d ){
+	return d == SLAB_UP ? 1 : local->plan->nrow-2;
+}
+
+/** Riga dell'alone d nel pianeta locale */
+static unsigned int halo_row( int d ){
+	return d == SLAB_UP ? 0 : local->plan->nrow-1;
+}
+
+/** Aggiorna un animale della striscia come fa il worker: le regole di wator.first.c nello stesso ordine,
+ *	con gli stati che impediscono di muovere due volte un animale o di muovere un figlio appena nato
+ */
+static void update_cell( unsigned int i, unsigned int j ){
+	planet_t *p = local->plan;
+	int dest_i = i, dest_j = j, son_i = i, son_j = j, dead = 0;
+	if ( p->w[i][j] == FISH ){
+		testMinus( fish_rule4( local, i, j, &son_i, &son_j ), "Applaying fish rule 4", NOPERROR);
+		testMinus( fish_rule3( local, i, j, &dest_i, &dest_j ), "Applaying fish rule 3", NOPERROR);
+	}else{
+		dead = DEAD==testMinus( shark_rule2( local, i, j, &son_i, &son_j ), "Applaying shark rule 2", NOPERROR);
+		if ( ! dead )
+			testMinus( shark_rule1( local, i, j, &dest_i, &dest_j ), "Applaying shark rule 1", NOPERROR);
+	}
+	if ( son_i != i || son_j != j ) local_state[ (size_t) son_i*p->ncol + son_j ] = CREATED;
+	if ( ! dead ){
+		local_state[ (size_t) dest_i*p->ncol + dest_j ] = MOVED;
+		/* gli spostamenti verso un alone sono solo verticali: la colonna è la stessa */
+		if ( dest_i == halo_row( SLAB_UP ) || dest_i == halo_row( SLAB_DOWN ) ){
+			moved[ dest_i == halo_row( SLAB_UP ) ? SLAB_UP : SLAB_DOWN ][dest_j] = 1;
+			/* finché il vicino non accetta l'arrivo la cella di partenza resta occupata: uno squalo
+			 * non viene mangiato e non lascia spazio a nessuno ( lo stato MOVED lo esclude dall'update ) */
+			p->w[i][j] = SHARK;
+		}
+	}
+}
+
+/** Scrive l'animale mv nella riga r del pianeta locale */
+static void put_move( planet_t *p, unsigned int r, const slab_move_t *mv ){
+	p->w[r][mv->col] = mv->cell;
+	p->btime[r][mv->col] = mv->btime;
+	p->dtime[r][mv->col] = mv->dtime;
+}
+
+/** Esegue un chronon della striscia, scambiando aloni ed arrivi con i vicini */
+static void slab_update( ){
+	planet_t *p = local->plan;
+	unsigned int h = p->nrow-2, i, j;
+	size_t rowlen = p->ncol*sizeof(cell_t);
+	const void *out[2];
+	void *in[2];
+	size_t out_len[2], in_len[2];
+	int d, n[2], m[2];
+
+	/* 1) la prima riga va al vicino in alto, che ne fa il suo alone in basso, l'ultima al vicino in basso */
+	out[SLAB_UP] = p->w[1];
+	out[SLAB_DOWN] = p->w[h];
+	in[SLAB_UP] = p->w[0];
+	in[SLAB_DOWN] = p->w[h+1];
+	out_len[0] = out_len[1] = in_len[0] = in_len[1] = rowlen;
+	exchange( out, out_len, in, in_len );
+	for ( d=0; d<2; d++ ){
+		memcpy( halo[d], p->w[halo_row(d)], rowlen );
+		memset( moved[d], 0, p->ncol );
+	}
+
+	/* 2) aggiornamento delle sole righe della striscia */
+	memset( local_state, UNKNOWN, sizeof(cell_state_t)*p->nrow*p->ncol );
+	for ( i=1; i<=h; i++ )
+		for ( j=0; j<p->ncol; j++ )
+			if ( p->w[i][j] != WATER && local_state[ (size_t) i*p->ncol + j ] == UNKNOWN )
+				update_cell( i, j );
+
+	/* 3) le celle cambiate dell'alone sono gli arrivi per il vicino */
+	for ( d=0; d<2; d++ ){
+		unsigned int r = halo_row( d );
+		n[d] = 0;
+		for ( j=0; j<p->ncol; j++ )
+			if ( p->w[r][j] != halo[d][j] ){
+				slab_move_t *mv = out_moves[d] + n[d]++;
+				mv->col = j;
+				mv->cell = p->w[r][j];
+				mv->btime = p->btime[r][j];
+				mv->dtime = p->dtime[r][j];
+				mv->moved = moved[d][j];
+			}
+	}
+	out[0] = &n[0]; out[1] = &n[1];
+	in[0] = &m[0]; in[1] = &m[1];
+	out_len[0] = out_len[1] = in_len[0] = in_len[1] = sizeof(int);
+	exchange( out, out_len, in, in_len );
+	/* un vicino non manda più arrivi delle celle di una riga */
+	for ( d=0; d<2; d++ )
+		if ( m[d] < 0 || (unsigned int) m[d] > p->ncol ) Log("Slab neighbour sent too many moves", FATAL, NOPERROR);
+	for ( d=0; d<2; d++ ){
+		out[d] = out_moves[d];
+		in[d] = in_moves[d];
+		out_len[d] = n[d]*sizeof(slab_move_t);
+		in_len[d] = m[d]*sizeof(slab_move_t);
+	}
+	exchange( out, out_len, in, in_len );
+
+	/* gli arrivi dal vicino d cadono nella riga di confine dal suo lato */
+	for ( d=0; d<2; d++ ){
+		unsigned int r = border_row( d );
+		int k;
+		for ( k=0; k<m[d]; k++ ){
+			slab_move_t *mv = in_moves[d] + k;
+			cell_t *target;
+			if ( mv->col < 0 || (unsigned int) mv->col >= p->ncol || ( mv->cell != FISH && mv->cell != SHARK ) )
+				Log("Slab neighbour sent a bad move", FATAL, NOPERROR);
+			target = &( p->w[r][mv->col] );
+			if ( ( in_acks[d][k] = *target == WATER || ( mv->cell == SHARK && *target == FISH ) ) )
+				put_move( p, r, mv );
+		}
+	}
+
+	/* 4) risposte: le celle di partenza degli animali accettati si liberano, i respinti vi restano */
+	for ( d=0; d<2; d++ ){
+		out[d] = in_acks[d];
+		in[d] = out_acks[d];
+		out_len[d] = m[d];
+		in_len[d] = n[d];
+	}
+	exchange( out, out_len, in, in_len );
+	for ( d=0; d<2; d++ ){
+		unsigned int r = border_row( d );
+		int k;
+		for ( k=0; k<n[d]; k++ ){
+			slab_move_t *mv = out_moves[d] + k;
+			if ( ! mv->moved ) continue;
+			if ( out_acks[d][k] ){
+				p->w[r][mv->col] = WATER;
+				p->btime[r][mv->col] = p->dtime[r][mv->col] = 0;
+			}else
+				put_move( p, r, mv );
+		}
+	}
+}
+
+/** Conta gli animali di tipo e nella striscia ( aloni esclusi ) */
+static int slab_count( cell_t e ){
+	planet_t *p = local->plan;
+	size_t i, area = (size_t) (p->nrow-2)*p->ncol;
+	int r = 0;
+	for ( i=0; i<area; i++ ) r += p->w[1][i] == e;
+	return r;
+}
+
+void slab_main( const char *addr ){
+	slab_setup_t s;
+	char my_addr[SLAB_ADDR_LEN];
+	slab_cmd_t cmd;
+	int cfd, lfd, d;
+	size_t area;
+
+	{	/* la terminazione è comandata dal coordinatore: i segnali sono ignorati, come in visualizer */
+		struct sigaction sa;
+		memset( &sa, 0, sizeof(sa) );
+		sa.sa_handler = SIG_IGN;
+		testMinus( sigaction( SIGINT, &sa, NULL ) , "SIGACTION", PERROR);
+		testMinus( sigaction( SIGTERM, &sa, NULL ) , "SIGACTION", PERROR);
+		testMinus( sigaction( SIGALRM, &sa, NULL ) , "SIGACTION", PERROR);
+		testMinus( sigaction( SIGUSR1, &sa, NULL ) , "SIGACTION", PERROR);
+		testMinus( sigaction( SIGPIPE, &sa, NULL ) , "SIGACTION", PERROR);
+	}
+
+	cfd = slab_connect( addr );
+	/* socket su cui attendo il vicino in alto: con TCP su una porta scelta dal sistema */
+	memset( my_addr, 0, sizeof(my_addr) );
+	if ( strchr( addr, ':' ) ){
+		struct sockaddr_in sa;
+		socklen_t len = sizeof(sa);
+		char host[INET_ADDRSTRLEN], any[SLAB_ADDR_LEN];
+		/* ascolto solo sull'interfaccia da cui raggiungo il coordinatore, su una porta scelta dal sistema */
+		testMinus( getsockname( cfd, (struct sockaddr*) &sa, &len ), "Slab socket name", PERROR );
+		inet_ntop( AF_INET, &sa.sin_addr, host, sizeof(host) );
+		snprintf( any, sizeof(any), "%s:0", host );
+		lfd = slab_listen( any );
+		len = sizeof(sa);
+		testMinus( getsockname( lfd, (struct sockaddr*) &sa, &len ), "Slab socket name", PERROR );
+		snprintf( my_addr, sizeof(my_addr), ":%d", ntohs( sa.sin_port ) );
+	}else{
+		snprintf( my_addr, sizeof(my_addr), SLAB_PEER_SOCK_FMT, (int) getpid() );
+		lfd = slab_listen( my_addr );
+	}
+	send_all( cfd, my_addr, sizeof(my_addr) );
+	recv_all( cfd, &s, sizeof(s) );
+	s.down[SLAB_ADDR_LEN-1] = '\0';
+
+	/* pianeta locale: la striscia tra i due aloni. Un eventuale file di appoggio ( -m ) è del coordinatore */
+	set_planet_backing( NULL );
+	local = testedMalloc( sizeof(wator_t) );
+	local->sd = s.sd;
+	local->sb = s.sb;
+	local->fb = s.fb;
+	local->nwork = 1;
+	local->chronon = 1;
+	testNull( local->plan = new_planet( s.nrows+2, s.ncol ), "Slab planet", PERROR );
+	area = (size_t) s.nrows*s.ncol;
+	recv_all( cfd, local->plan->w[1], area*sizeof(cell_t) );
+	recv_all( cfd, local->plan->btime[1], area*sizeof(int) );
+	recv_all( cfd, local->plan->dtime[1], area*sizeof(int) );
+	local->nf = slab_count( FISH );
+	local->ns = slab_count( SHARK );
+
+	local_state = testedMalloc( sizeof(cell_state_t)*(area+2*s.ncol) );
+	for ( d=0; d<2; d++ ){
+		halo[d] = testedMalloc( sizeof(cell_t)*s.ncol );
+		moved[d] = testedMalloc( s.ncol );
+		out_moves[d] = testedMalloc( sizeof(slab_move_t)*s.ncol );
+		in_moves[d] = testedMalloc( sizeof(slab_move_t)*s.ncol );
+		out_acks[d] = testedMalloc( s.ncol );
+		in_acks[d] = testedMalloc( s.ncol );
+	}
+	show_buff = testedMalloc( sizeof(bits_t)*( (area+4)>>2 ) );
+	/* ogni striscia ha la propria sequenza casuale */
+	rng_init( 1 + s.index );
+
+	/* la connect al vicino in basso si conclude senza attendere la sua accept: nessuno resta bloccato */
+	peer[SLAB_DOWN] = slab_connect( s.down );
+	peer[SLAB_UP] = slab_accept( lfd );
+	close( lfd );
+	if ( my_addr[0] != ':' ) unlink( my_addr );
+	for ( d=0; d<2; d++ )
+		testMinus( fcntl( peer[d], F_SETFL, fcntl( peer[d], F_GETFL ) | O_NONBLOCK ), "Slab fcntl", PERROR );
+	Log("Slab ready", DEBUG, NOPERROR);
+
+	/* ciclo dei comandi del coordinatore */
+	do{
+		recv_all( cfd, &cmd, sizeof(cmd) );
+		switch ( cmd ){
+			case SLAB_CMD_STEP: {
+				int cnt[2];
+				slab_update( );
+				cnt[0] = local->nf = slab_count( FISH );
+				cnt[1] = local->ns = slab_count( SHARK );
+				send_all( cfd, cnt, sizeof(cnt) );
+				break;
+			}
+			case SLAB_CMD_SHOW: {
+				wide_t bits_len = compress( show_buff, local->plan->w[1], area );
+				send_all( cfd, &bits_len, sizeof(wide_t) );
+				send_all( cfd, show_buff, top( bits_len, 4 ) );
+				break;
+			}
+			case SLAB_CMD_STATE:
+				send_all( cfd, local->plan->w[1], area*sizeof(cell_t) );
+				send_all( cfd, local->plan->btime[1], area*sizeof(int) );
+				send_all( cfd, local->plan->dtime[1], area*sizeof(int) );
+				break;
+			case SLAB_CMD_EXIT:
+				Log("Slab <- EXIT", DEBUG, NOPERROR);
+				break;
+			default: Log("Slab <- INVALID CMD", FATAL, NOPERROR); break;
+		}
+	}while ( cmd != SLAB_CMD_EXIT );
+
+	close( cfd );
+	close( peer[SLAB_UP] );
+	close( peer[SLAB_DOWN] );
+	for ( d=0; d<2; d++ ){
+		free( halo[d] );
+		free( moved[d] );
+		free( out_moves[d] );
+		free( in_moves[d] );
+		free( out_acks[d] );
+		free( in_acks[d] );
+	}
+	free( local_state );
+	free( show_buff );
+	free_wator( local );
+}
@@ -52,15 +52,28 @@ void closeVisualizer( ){
 	close (fd);
 }
 
-void visualizer_init( int nrow, int ncol ) {
+/* vista a cui visualizer si è abbonato in risposta alla init */
+static view_t view;
+
+void visualizer_init( wide_t nrow, wide_t ncol ) {
 	SOCK_CMDS cmd;
+	int version = SOCK_PROTOCOL_VERSION;
 	/* apre la connessione ed assegna il suo file descriptor ad fd */
 	int fd = create_connection();
-	/* scrivo al socket il comando di init con la descrizione del pianeta */
+	/* scrivo al socket il comando di init con la versione del protocollo e la descrizione del pianeta */
 	cmd = SOCK_CMD_INIT;
 	write(fd, &cmd, sizeof(SOCK_CMDS));
-	write(fd, &nrow, sizeof(int) );
-	write(fd, &ncol, sizeof(int) );
+	write(fd, &version, sizeof(int) );
+	write(fd, &nrow, sizeof(wide_t) );
+	write(fd, &ncol, sizeof(wide_t) );
+	/* visualizer risponde con la propria versione: i campi che seguono hanno senso solo se coincide */
+	if ( read(fd, &version, sizeof(int)) != sizeof(int) )
+		Log("Reading visualizer protocol version", FATAL, PERROR);
+	if ( version != SOCK_PROTOCOL_VERSION )
+		Log("Visualizer speaks another protocol version", FATAL, NOPERROR);
+	/* visualizer risponde con la vista a cui si abbona (già adattata alle dimensioni del pianeta) */
+	if ( read(fd, &view, sizeof(view_t)) != sizeof(view_t) )
+		Log("Reading visualizer subscription", FATAL, PERROR);
 	/* chiudo la connessione */
 	cmd = SOCK_CMD_QUIT;
 	write(fd, &cmd, sizeof(SOCK_CMDS));
@@ -68,41 +81,337 @@ void visualizer_init( int nrow, int ncol ) {
 	close(fd);
 }
 
-void show(cell_t*w, int nrow, int ncol){
+/* frame pronto per esser inviato a visualizer */
+typedef struct {
+	SOCK_CMDS cmd; 	/* SOCK_CMD_SHOW_AND_QUIT, SOCK_CMD_PATCH_AND_QUIT o SOCK_CMD_DENSITY_AND_QUIT */
+	bits_t *buff; 	/* immagine compressa della vista, sequenza di sotto matrici o conteggi per blocco */
+	wide_t bits_len; 	/* dimensione dell'immagine (bits), numero di sotto matrici o di blocchi */
+	wide_t brow, bcol; 	/* righe e colonne della griglia di blocchi (solo densità) */
+	wide_t len; 	/* byte occupati da buff (solo patch) */
+	int epoch; 	/* chronon a cui il frame si riferisce */
+} frame_t;
+
+/* chronon dell'ultimo frame consegnato al socket: le patch partono da qui */
+static int delivered = -1;
+
+/** Crea l'immagine compressa di una matrice linearizzata
+ *	param w: matrice da comprimere
+ *	param area: numero di celle di w
+ *	retval: frame allocato, da liberare con free_frame
+ */
+static frame_t * encode_cells( cell_t*w, wide_t area ){
+	frame_t *f = testedMalloc( sizeof(frame_t) );
+	f->cmd = SOCK_CMD_SHOW_AND_QUIT;
+	/* creo un buffer in cui scrivere l'immagine del pianeta (la dimensione è area/4 arrotondata per eccesso)*/
+	f->buff = testedMalloc( sizeof(bits_t)*( (area+4)>>2 ) ); /* (area+4)>>2 lunghezza massima */
+	/* creo l'immagine (comprimendo il pianeta) e memorizzo la sua lunghezza */
+	f->bits_len = compress( f->buff, w, area );
+	return f;
+}
+
+/** Crea l'immagine compressa della sola finestra della vista
+ *	la finestra è copiata riga per riga (con wrap toroidale) prima di esser compressa
+ */
+static frame_t * encode_window( cell_t*w, wide_t nrow, wide_t ncol ){
+	frame_t *f;
+	wide_t i,j;
+	cell_t *win = testedMalloc( sizeof(cell_t)*view.nrow*view.ncol );
+	for ( i=0; i<view.nrow; i++ ){
+		cell_t *row = w + ( (view.r0+i) % nrow )*ncol;
+		for ( j=0; j<view.ncol; j++ )
+			win[i*view.ncol+j] = row[ (view.c0+j) % ncol ];
+	}
+	f = encode_cells( win, view.nrow*view.ncol );
+	free( win );
+	return f;
+}
+
+/** Conta pesci e squali in ogni blocco view.block x view.block del pianeta
+ *	I conteggi sono scritti a coppie <pesci,squali> in ordine di riga dei blocchi
+ */
+static frame_t * encode_density( cell_t*w, wide_t nrow, wide_t ncol ){
+	frame_t *f = testedMalloc( sizeof(frame_t) );
+	wide_t B = view.block;
+	wide_t i,j,b;
+	wide_t *cnt;
+	f->cmd = SOCK_CMD_DENSITY_AND_QUIT;
+	f->brow = top( nrow, B );
+	f->bcol = top( ncol, B );
+	f->bits_len = f->brow*f->bcol;
+	cnt = testedMalloc( sizeof(wide_t)*2*f->bits_len );
+	memset( cnt, 0, sizeof(wide_t)*2*f->bits_len );
+	for ( i=0; i<nrow; i++ ){
+		/* coppie della riga di blocchi che contiene la riga i */
+		wide_t *brow = cnt + 2*(i/B)*f->bcol;
+		cell_t *row = w + i*ncol;
+		/* scorro la riga un blocco alla volta, evitando una divisione per cella */
+		for ( j=0, b=0; j<ncol; b++ ){
+			wide_t end = MIN( j+B, ncol );
+			for ( ; j<end; j++ )
+				switch ( row[j] ){
+					case FISH: brow[2*b]++; break;
+					case SHARK: brow[2*b+1]++; break;
+					default: break;
+				}
+		}
+	}
+	f->buff = (bits_t*) cnt;
+	return f;
+}
+
+/** Crea una patch con le sole sotto matrici cambiate dopo il chronon since.
+ *	Ogni sotto matrice è scritta come <r0,c0,nrow,ncol,bits_len,seq_len><immagine compressa>
+ *	param ndirty: numero di sotto matrici cambiate
+ */
+static frame_t * encode_patch( cell_t*w, wide_t ncol, int since, wide_t ndirty ){
+	frame_t *f = testedMalloc( sizeof(frame_t) );
+	wide_t t;
+	f->cmd = SOCK_CMD_PATCH_AND_QUIT;
+	f->bits_len = ndirty;
+	f->buff = testedMalloc( ndirty*( 6*sizeof(wide_t) + SUB_ENC_LEN ) );
+	f->len = 0;
+	for ( t=0; t<num_of_subs; t++ ){
+		sub_planet_t *sub = sub_planets+t;
+		wide_t hdr[6];
+		if ( sub->stamp <= since ) continue;
+		hdr[0] = sub->_row;
+		hdr[1] = sub->_col;
+		hdr[2] = sub->_nrow;
+		hdr[3] = sub->_ncol;
+		/* immagine già compressa dal worker durante l'update, se nessuno l'ha modificata dopo */
+		if ( sub->enc_valid ){
+			hdr[4] = sub->enc_bits;
+			memcpy( f->buff + f->len + sizeof(hdr), sub->enc, top( hdr[4], 4 ) );
+		}else
+			hdr[4] = encode_sub( sub, f->buff + f->len + sizeof(hdr) );
+		hdr[5] = top( hdr[4], 4 );
+		memcpy( f->buff + f->len, hdr, sizeof(hdr) );
+		f->len += sizeof(hdr) + hdr[5];
+	}
+	return f;
+}
+
+/** Crea l'immagine dell'intero pianeta: se visualizer ha già un frame e poche sotto matrici
+ *	sono cambiate da allora invia solo quelle, altrimenti l'intero pianeta compresso.
+ *	Con la codifica fusa le sotto matrici sono già compresse: si inviano sempre a sotto matrici
+ */
+static frame_t * encode_full( cell_t*w, wide_t nrow, wide_t ncol, int since ){
+	wide_t t, ndirty = 0;
+	if ( since >= 0 )
+		for ( t=0; t<num_of_subs; t++ )
+			if ( sub_planets[t].stamp > since ) ndirty++;
+	/* la simulazione divisa tra processi non ha sotto matrici: si invia sempre l'intero pianeta */
+	if ( fused_encoding && num_of_subs )
+		return encode_patch( w, ncol, since, since < 0 ? num_of_subs : ndirty );
+	/* oltre metà delle sotto matrici, la compressione dell'intero pianeta rende di più */
+	if ( since < 0 || ! num_of_subs || 2*ndirty > num_of_subs )
+		return encode_cells( w, nrow*ncol );
+	return encode_patch( w, ncol, since, ndirty );
+}
+
+/** Crea il frame da inviare secondo la vista a cui visualizer si è abbonato
+ *	param since: chronon dell'ultimo frame consegnato (-1 per un frame completo)
+ */
+static frame_t * encode_frame( cell_t*w, wide_t nrow, wide_t ncol, int since ){
+	frame_t *f;
+	switch ( view.kind ){
+		case VIEW_WINDOW: f = encode_window( w, nrow, ncol ); break;
+		case VIEW_DENSITY: f = encode_density( w, nrow, ncol ); break;
+		case VIEW_FULL: default: f = encode_full( w, nrow, ncol, since ); break;
+	}
+	f->epoch = current_chronon;
+	return f;
+}
+
+static void free_frame( frame_t *f ){
+	free( f->buff );
+	free( f );
+}
+
+/** Invia a visualizer un frame già compresso 
+ *	param f: frame da inviare
+ */
+static void send_frame( frame_t *f ){
 	SOCK_CMDS cmd;
 	/* apre la connessione ed assegna il suo file descriptor ad fd */
 	int fd = create_connection();
-	int area = nrow*ncol;
-	int bits_len;
-	int seq_len ;
-	/* creo un buffer in cui scrivere l'immagine del pianeta (la dimensione è area/4 arrotondata per eccesso)*/
-	bits_t *buff = testedMalloc( sizeof(bits_t)*( (area+4)>>2 ) ); /* (area+4)>>2 lunghezza massima */
-	/* creo l'immagine (comprimendo il pianeta) e memorizzo la sua lunghezza */
-	bits_len = compress( buff, w, area );
-	/* stabilisco quanti byte trasmettere */
-	seq_len = top(bits_len, 4);
-		
-	/* scrivo al socket il comando show ed invio l'immagine */
-	cmd = SOCK_CMD_SHOW_AND_QUIT;
+	wide_t seq_len;
+	
+	cmd = f->cmd;
 	write(fd, &cmd, sizeof(SOCK_CMDS));
-	write(fd, &bits_len, sizeof(int) ); /* dimensione dell'immagine (bits) */
-	write(fd, &seq_len , sizeof(int) ); /* byte occupati dall'immagine */
-	write(fd, buff, seq_len*sizeof(bits_t) );
+	if ( cmd == SOCK_CMD_DENSITY_AND_QUIT ){
+		/* griglia dei blocchi seguita dalle coppie di conteggi */
+		write(fd, &(f->brow), sizeof(wide_t) );
+		write(fd, &(f->bcol), sizeof(wide_t) );
+		write(fd, f->buff, 2*f->bits_len*sizeof(wide_t) );
+	}else if ( cmd == SOCK_CMD_PATCH_AND_QUIT ){
+		/* numero di sotto matrici seguito dalle sotto matrici */
+		write(fd, &(f->bits_len), sizeof(wide_t) );
+		write(fd, f->buff, f->len );
+	}else{
+		/* stabilisco quanti byte trasmettere */
+		seq_len = top(f->bits_len, 4);
+		/* invio l'immagine */
+		write(fd, &(f->bits_len), sizeof(wide_t) ); /* dimensione dell'immagine (bits) */
+		write(fd, &seq_len , sizeof(wide_t) ); /* byte occupati dall'immagine */
+		write(fd, f->buff, seq_len*sizeof(bits_t) );
+	}
 	
-	/* chiusura di questo lato della connessione e liberazione della memoria */
+	/* chiusura di questo lato della connessione */
 	close(fd);
-	free( buff );
+}
+
+void show(cell_t*w, wide_t nrow, wide_t ncol){
+	frame_t *f = encode_frame( w, nrow, ncol, -1 );
+	send_frame( f );
+	free_frame( f );
+}
+
+/********************************************************************************************************************************* /
+  *
+  *										POLITICA DI INVIO DEI FRAME
+  *		Con le politiche diverse da SHOW_POLICY_BLOCK l'invio è delegato ad un thread (sender):
+  *		il collector comprime il pianeta (che è fermo tra due chronon) e deposita il frame in una
+  *		casella da un solo posto (mailbox), da cui il sender lo preleva. La simulazione quindi
+  *		non attende mai visualizer, se non per l'ultimo frame.
+  *
+/ *********************************************************************************************************************************/
+
+static show_policy_t show_policy = SHOW_POLICY_BLOCK;
+static show_stats_t show_stats;
+/* casella condivisa: sharedItem è il frame in attesa di esser inviato (o NULL) */
+static SycCont mailbox;
+/* vero mentre il sender sta scrivendo un frame sul socket */
+static int sender_busy;
+/* vero quando il sender deve terminare */
+static int sender_stop;
+/* politica adattiva: viene prodotto un frame ogni stride richieste */
+static int stride, skipped;
+static pthread_t t_sender;
+
+/** Ciclo del thread sender: preleva dalla mailbox ed invia, fino alla richiesta di stop
+ */
+static void* main_sender( void* args ){
+	frame_t *f;
+	setSignals();
+	do{
+		syc_lock( mailbox );
+		while ( ! mailbox->sharedItem && ! sender_stop )
+			pthread_cond_wait( mailbox->cond_var, mailbox->mutex );
+		/* lo stop viene servito solo a mailbox vuota: l'ultimo frame non va perso */
+		if (( f = mailbox->sharedItem )){
+			mailbox->sharedItem = NULL;
+			sender_busy = 1;
+			/* da ora il frame arriverà di certo: le prossime patch possono partire da lui */
+			delivered = f->epoch;
+		}
+		syc_unlock( mailbox );
+		
+		if ( f ){
+			send_frame( f );
+			free_frame( f );
+			syc_lock( mailbox );
+			sender_busy = 0;
+			show_stats.sent++;
+			/* sveglio un eventuale collector in attesa dell'invio dell'ultimo frame */
+			pthread_cond_broadcast( mailbox->cond_var );
+			syc_unlock( mailbox );
+		}
+	}while ( f );
+	return 0;
+}
+
+void show_setup( show_policy_t policy ){
+	show_policy = policy;
+	memset( &show_stats, 0, sizeof(show_stats) );
+	if ( policy == SHOW_POLICY_BLOCK ) return;
+	mailbox = syc_create( NULL );
+	sender_busy = sender_stop = 0;
+	stride = 1;
+	skipped = 0;
+	if ( pthread_create( &t_sender, NULL, main_sender, NULL ) ) Log("Create sender", FATAL, NOPERROR );
+}
+
+void show_frame( cell_t*w, wide_t nrow, wide_t ncol, int last ){
+	frame_t *f;
+	int since;
+	if ( show_policy == SHOW_POLICY_BLOCK ){
+		/* comportamento storico: il collector invia direttamente */
+		show_stats.produced++;
+		f = encode_frame( w, nrow, ncol, delivered );
+		send_frame( f );
+		delivered = f->epoch;
+		free_frame( f );
+		show_stats.sent++;
+		return;
+	}
+	
+	syc_lock( mailbox );
+	show_stats.produced++;
+	if ( show_policy == SHOW_POLICY_ADAPTIVE && ! last ){
+		/* salto le richieste fino a raggiungere lo stride corrente (senza comprimere) */
+		if ( ++skipped < stride ){
+			show_stats.dropped++;
+			syc_unlock( mailbox );
+			return;
+		}
+		skipped = 0;
+		if ( sender_busy || mailbox->sharedItem ){
+			/* visualizer non ha ancora smaltito il frame precedente: dirado le show */
+			stride = MIN( stride*2, MAX_SHOW_STRIDE );
+			show_stats.dropped++;
+			syc_unlock( mailbox );
+			return;
+		}
+		/* visualizer ha recuperato: torno gradualmente alla frequenza richiesta */
+		if ( stride > 1 ) stride--;
+	}
+	/* la patch parte dall'ultimo frame prelevato dal sender: se quello in attesa verrà
+	 * sostituito, le sue sotto matrici sono comunque incluse in questo */
+	since = delivered;
+	syc_unlock( mailbox );
+	
+	/* il pianeta è fermo, quindi la compressione può avvenire fuori dalla zona critica */
+	f = encode_frame( w, nrow, ncol, since );
+	
+	syc_lock( mailbox );
+	if ( mailbox->sharedItem ){
+		/* il frame in attesa non è mai stato inviato: lo sostituisco col più recente */
+		free_frame( mailbox->sharedItem );
+		show_stats.dropped++;
+	}
+	mailbox->sharedItem = f;
+	pthread_cond_broadcast( mailbox->cond_var );
+	if ( last )
+		/* l'ultimo frame deve arrivare a visualizer prima della sua chiusura */
+		while ( mailbox->sharedItem || sender_busy )
+			pthread_cond_wait( mailbox->cond_var, mailbox->mutex );
+	syc_unlock( mailbox );
+}
+
+show_stats_t show_teardown( ){
+	if ( show_policy != SHOW_POLICY_BLOCK ){
+		syc_lock( mailbox );
+		sender_stop = 1;
+		pthread_cond_broadcast( mailbox->cond_var );
+		syc_unlock( mailbox );
+		if ( pthread_join( t_sender, NULL ) ) Log("Join sender", FATAL, NOPERROR );
+		syc_destroy( mailbox );
+	}
+	return show_stats;
 }
 
 
 /* deprecated */
-void show_stepped(cell_t*w, int nrow, int ncol){
+void show_stepped(cell_t*w, wide_t nrow, wide_t ncol){
 	SOCK_CMDS cmd;
 	/* apre la connessione ed assegna il suo file descriptor ad fd */
 	int fd = create_connection();
-	int area = nrow*ncol;
-	int bits_len;
-	int seq_len ;
+	int version = SOCK_PROTOCOL_VERSION;
+	view_t ignored;
+	wide_t area = nrow*ncol;
+	wide_t bits_len;
+	wide_t seq_len ;
 	/* creo un buffer in cui scrivere l'immagine del pianeta (la dimensione è area/4 arrotondata per eccesso)*/
 	bits_t *buff = testedMalloc( sizeof(bits_t)*( (area+4)>>2 ) ); /* (area+4)>>2 lunghezza massima */
 	/* creo l'immagine (comprimendo il pianeta) e memorizzo la sua lunghezza */
@@ -118,14 +427,18 @@ void show_stepped(cell_t*w, int nrow, int ncol){
 	/* scrivo al socket il comando di init con la descrizione del pianeta */
 	cmd = SOCK_CMD_INIT;
 	write(fd, &cmd, sizeof(SOCK_CMDS));
-	write(fd, &nrow, sizeof(int) );
-	write(fd, &ncol, sizeof(int) );
+	write(fd, &version, sizeof(int) );
+	write(fd, &nrow, sizeof(wide_t) );
+	write(fd, &ncol, sizeof(wide_t) );
+	/* la risposta (versione e vista) non è usata: si invia sempre l'intero pianeta */
+	read(fd, &version, sizeof(int) );
+	read(fd, &ignored, sizeof(view_t) );
 	
 	/* scrivo al socket il comando show ed invio l'immagine */
 	cmd = SOCK_CMD_SHOW;
 	write(fd, &cmd, sizeof(SOCK_CMDS));
-	write(fd, &bits_len, sizeof(int) ); /* dimensione dell'immagine (bits) */
-	write(fd, &seq_len , sizeof(int) ); /* byte occupati dall'immagine */
+	write(fd, &bits_len, sizeof(wide_t) ); /* dimensione dell'immagine (bits) */
+	write(fd, &seq_len , sizeof(wide_t) ); /* byte occupati dall'immagine */
 	write(fd, buff, seq_len*sizeof(bits_t) );
 	
 	/* chiudo la connessione */
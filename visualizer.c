@@ -10,47 +10,109 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <string.h>
+#include <inttypes.h>
 #include <wait.h>
 /*Includo le funzionalità di core ( servirà sycqueue e decompres ) + costanti */
 #include "core.h"
 
 /* le memorizzo solo una volta nel caso di init */
-int nrow, ncol;
+wide_t nrow, ncol;
+/* vista a cui visualizer si abbona (passata come opzione da wator) */
+view_t view;
+/* ultima immagine ricevuta della vista */
+cell_t *matrix = NULL;
 
 /*Abbreviazione*/
 #define READ(fd,ind,dim) (checked_read(fd,ind,dim))
 
 /** Funzione che effettua una read controllando che essa avvenga in maniera corretta
- *	Lancia Log come FATAL nel caso in cui il numero di byte atteso non corrisponda a quello letto
+ *	Le immagini di pianeti grandi arrivano in più pezzi: si legge finché non si hanno dim byte.
+ *	Lancia Log come FATAL se la connessione termina prima o in caso di errore
  *	param fd: file descriptor da cui leggere
  *	param ind: area di memoria da riempire ( deve esser stata preallocata )
  *	param dim: numero di byte atteso MAGGIORE di 1 
  */
-void checked_read(int fd,void *ind,int dim){
-	/* effettuo la lettura trammite sc e memorizzo il numero di byte letti */
-	int nbr = read(fd,ind,dim) ;
-	/* discrimino i casi sulla base di quanti byte ho letto */
-	switch(nbr){ 
-		/* read ritorna 0 quando raggiunto l'end of file, quindi non è stato letto nulla */
-		case 0: 	Log("Unexpected end of sock", FATAL, NOPERROR); break;
-		/* gestione di errore */
-		case -1: 	Log("Error read",FATAL,PERROR); break; 
-		/* ho letto nbr>0 byte => controllo che corrispondano a quanti ne volevo! */
-		default: 	if ( nbr != dim ) Log("Read unsufficient bytes", FATAL, NOPERROR); break; 
-	}	
+void checked_read(int fd,void *ind,size_t dim){
+	char *dest = ind;
+	while ( dim > 0 ){
+		/* effettuo la lettura trammite sc e memorizzo il numero di byte letti */
+		ssize_t nbr = read(fd,dest,dim) ;
+		/* discrimino i casi sulla base di quanti byte ho letto */
+		switch(nbr){ 
+			/* read ritorna 0 quando raggiunto l'end of file, quindi non è stato letto nulla */
+			case 0: 	Log("Unexpected end of sock", FATAL, NOPERROR); break;
+			/* gestione di errore */
+			case -1: 	Log("Error read",FATAL,PERROR); break; 
+			/* ho letto nbr>0 byte => proseguo con i rimanenti */
+			default: 	dest += nbr; dim -= nbr; break; 
+		}	
+	}
+}
+
+/** Adatta la vista richiesta alle dimensioni del pianeta appena ricevute con la init
+ */
+void clamp_view(){
+	switch ( view.kind ){
+		case VIEW_WINDOW:
+			/* l'angolo è preso in modulo, la finestra non può eccedere il pianeta */
+			view.r0 %= nrow;
+			view.c0 %= ncol;
+			if ( view.nrow > nrow ) view.nrow = nrow;
+			if ( view.ncol > ncol ) view.ncol = ncol;
+			break;
+		case VIEW_DENSITY: break;
+		case VIEW_FULL: default:
+			view.r0 = view.c0 = 0;
+			view.nrow = nrow;
+			view.ncol = ncol;
+			break;
+	}
+}
+
+/** Stampa su outstream l'ultima immagine ricevuta della vista (intero pianeta o finestra)
+ *	param outstream: stream su cui scrivere
+ */
+void print_view( FILE * outstream ){
+	wide_t i;
+	/* nel caso stia visualizzando su file, lo riscrivo dalla cima */
+	if ( outstream != stdout ) rewind( outstream );
+	/* print di di plan (o della sola finestra) */
+	fprintf (outstream, "%" PRId64 "\n%" PRId64 "\n", view.nrow, view.ncol);
+	for (i=0; i<view.nrow; i++){
+		wide_t j;
+		for (j=0; j<view.ncol; j++){
+			#ifndef COLOR_DEBUG
+			fprintf(outstream, "%c%c", cell_to_char( matrix[i*view.ncol+j] ), (j==view.ncol-1)?'\n':' ' ); 
+			#else
+			switch ( matrix[i*view.ncol+j] ) {
+				case WATER :fprintf (outstream, "\x1b[34m" "W " "\x1b[0m" );break;
+				case SHARK :fprintf (outstream, "\x1b[31m" "S " "\x1b[0m" );break;
+				case FISH  :fprintf (outstream, "\x1b[32m" "F " "\x1b[0m" );break;
+			}
+			#endif
+		}
+		#ifdef COLOR_DEBUG
+		fprintf(outstream, "\n");
+		#endif
+	}
+	/* end print */			
 }
 
 /** Funzione che gestisce il ciclo di fetching dei comandi che arrivano dalla socket.
  *	Si basa sulla filosofia generale espressa in wator.c ovvero un ciclo degli eventi.
+ *	L'immagine della vista (matrix) sopravvive alla connessione, così che una patch
+ *	possa aggiornarla sul posto.
  *	param fd: file descriptor della socket 
  *	param outstream: stream su cui scrivere la matrice quando ricevuto il comando di show 
  *	retval: 1 se ricevuto exit, 0 altrimenti
  */
 int fetching ( int fd, FILE * outstream ) { 
 	SOCK_CMDS cmd;	/* comando da estrarre */
-	int seq_len, bits_len,i; /* lunghezza in byte della sequenza, lunghezza in bits ~ seq_len /4 */
+	wide_t seq_len, bits_len,i; /* lunghezza in byte della sequenza, lunghezza in bits ~ seq_len /4 */
+	wide_t brow, bcol; /* griglia dei blocchi della vista a densità */
+	int version, my_version = SOCK_PROTOCOL_VERSION; /* versione del protocollo usata da wator e da visualizer */
+	/* buffer per l'immagine compressa (vale per la sola connessione) */
 	bits_t *buff = NULL;
-	cell_t *matrix = NULL;
 
 	/* ciclo degli eventi */	
 	while ( 1 ){
@@ -65,65 +127,98 @@ int fetching ( int fd, FILE * outstream ) {
 				if ( matrix ) free( matrix );
 				/* => devo terminare il processo => retval 1 */
 			 	return 1; break;				
+			/* è stata inviata la vista a densità: coppie pesci,squali per blocco */
+			case SOCK_CMD_DENSITY_AND_QUIT: {
+				wide_t *cnt;
+				Log("server <- SOCK_CMD_DENSITY",DEBUG, NOPERROR);
+				if ( outstream != stdout ) rewind( outstream );
+				READ ( fd, &brow, sizeof( wide_t ) );	
+				READ ( fd, &bcol, sizeof( wide_t ) );	
+				cnt = testedMalloc( 2*sizeof(wide_t)*brow*bcol );
+				READ ( fd, cnt, 2*sizeof(wide_t)*brow*bcol );
+				/* stampo la griglia di blocchi come pesci:squali */
+				fprintf (outstream, "%" PRId64 "\n%" PRId64 "\n", brow, bcol);
+				for (i=0; i<brow*bcol; i++)
+					fprintf(outstream, "%" PRId64 ":%" PRId64 "%c", cnt[2*i], cnt[2*i+1], (i%bcol==bcol-1)?'\n':' ' );
+				free( cnt );
+				/* la vista a densità non usa buff e matrix: la connessione termina qui */
+				return 0;
+			}
 			 /* e' stato richiesto una init*/
 			case SOCK_CMD_INIT: 
 				Log("server <- SOCK_CMD_INIT",DEBUG, NOPERROR);
+				/* la versione precede i campi il cui formato dipende da essa: rispondo con la mia */
+				READ ( fd, &version, sizeof( int ) );
+				if ( write( fd, &my_version, sizeof(int) ) != sizeof(int) )
+					Log("Writing protocol version", FATAL, PERROR);
+				if ( version != my_version )
+					Log("Wator speaks another protocol version", FATAL, NOPERROR);
 				/* prelevo la descrizione del mondo */
-				READ ( fd, &nrow, sizeof( int ) );
-				READ ( fd, &ncol, sizeof( int ) );
+				READ ( fd, &nrow, sizeof( wide_t ) );
+				READ ( fd, &ncol, sizeof( wide_t ) );
 				/* controllo la validità della descrizione */
 				if ( nrow<1 || ncol<1 ) 
 					Log("Recived too small dims", FATAL, NOPERROR); 
-				/* creo i buffer temporanei */
-			case SOCK_CMD_SHOW_AND_QUIT:
-				/* array del tipo arrotondamento per eccesso della dimensione del mondo/4*/
-				buff = testedMalloc( sizeof(bits_t)*( (nrow*ncol+4) >> 2 ) );
-				/* array grande quanto il mondo */
-				matrix = testedMalloc( sizeof(cell_t)*nrow*ncol );
-				/* nel caso del comando composto procedo alla visualizzazione, se no sono nella init */
-				if ( cmd != SOCK_CMD_SHOW_AND_QUIT ) break;			
+				/* rispondo con la vista a cui mi abbono, adattata al pianeta */
+				clamp_view();
+				if ( write( fd, &view, sizeof(view_t) ) != sizeof(view_t) )
+					Log("Writing subscription", FATAL, PERROR);
+				/* immagine della vista grande quanto la vista, aggiornata dalle show e dalle patch */
+				if ( matrix ) free( matrix );
+				matrix = testedMalloc( sizeof(cell_t)*view.nrow*view.ncol );
+				for ( i=0; i<view.nrow*view.ncol; i++ ) matrix[i] = WATER;
+				break;
+			/* sono state inviate le sole sotto matrici cambiate dall'ultima show */
+			case SOCK_CMD_PATCH_AND_QUIT: {
+				wide_t n, hdr[6];
+				cell_t *tile = NULL;
+				Log("server <- SOCK_CMD_PATCH",DEBUG, NOPERROR);
+				if ( ! matrix ) Log("Sock un-init, but patch, called",FATAL,NOPERROR);
+				READ ( fd, &n, sizeof( wide_t ) );
+				while ( n-- ){
+					wide_t r,c;
+					/* r0, c0, nrow, ncol, bits_len, seq_len della sotto matrice */
+					READ ( fd, hdr, sizeof( hdr ) );
+					if ( hdr[0]<0 || hdr[1]<0 || hdr[0]+hdr[2]>view.nrow || hdr[1]+hdr[3]>view.ncol )
+						Log("Patch out of planet", FATAL, NOPERROR);
+					buff = realloc( buff, hdr[5] );
+					tile = realloc( tile, sizeof(cell_t)*hdr[2]*hdr[3] );
+					if ( ! buff || ! tile ) Log("Malloc fault", FATAL, NOPERROR);
+					READ ( fd, buff, hdr[5] );
+					decompress( tile, buff, hdr[4] );
+					/* applico la sotto matrice sul posto */
+					for ( r=0; r<hdr[2]; r++ )
+						for ( c=0; c<hdr[3]; c++ )
+							matrix[ (hdr[0]+r)*view.ncol + hdr[1]+c ] = tile[ r*hdr[3]+c ];
+				}
+				if ( tile ) free( tile );
+				print_view( outstream );
+				/* come per la densità, la connessione termina qui */
+				if ( buff ) free( buff );
+				return 0;
+			}
 			/* è stato richiesto di visualizzare il mondo */
+			case SOCK_CMD_SHOW_AND_QUIT:
 			case SOCK_CMD_SHOW: 
 				Log("server <- SOCK_CMD_SHOW",DEBUG, NOPERROR);
-				/* nel caso stia visualizzando su file, lo riscrivo dalla cima */
-				if ( outstream != stdout ) rewind( outstream );
 				/* controllo usi insoliti del "protocollo" */
-				if ( ! buff ) Log("Sock un-init, but show, called",FATAL,NOPERROR);
+				if ( ! matrix ) Log("Sock un-init, but show, called",FATAL,NOPERROR);
+				/* array del tipo arrotondamento per eccesso della dimensione della vista/4*/
+				if ( ! buff ) buff = testedMalloc( sizeof(bits_t)*( (view.nrow*view.ncol+4) >> 2 ) );
 				/* estraggo l'immagine del mondo */
-				READ ( fd, &bits_len, sizeof( int ) );	
-				READ ( fd, &seq_len, sizeof( int ) );	
+				READ ( fd, &bits_len, sizeof( wide_t ) );	
+				READ ( fd, &seq_len, sizeof( wide_t ) );	
 				READ ( fd, buff, seq_len );
 				
 				/* ripristino il formato I(plan) a plan */
 				decompress( matrix, buff, bits_len );
-
-				/* print di di plan */
-				fprintf (outstream, "%d\n%d\n", nrow, ncol);
-				for (i=0; i<nrow; i++){
-					int j;
-					for (j=0; j<ncol; j++){
-						#ifndef COLOR_DEBUG
-						fprintf(outstream, "%c%c", cell_to_char( matrix[i*ncol+j] ), (j==ncol-1)?'\n':' ' ); 
-						#else
-						switch ( matrix[i*ncol+j] ) {
-							case WATER :fprintf (outstream, "\x1b[34m" "W " "\x1b[0m" );break;
-							case SHARK :fprintf (outstream, "\x1b[31m" "S " "\x1b[0m" );break;
-							case FISH  :fprintf (outstream, "\x1b[32m" "F " "\x1b[0m" );break;
-						}
-						#endif
-					}
-					#ifdef COLOR_DEBUG
-					fprintf(outstream, "\n");
-					#endif
-				}
-				/* end print */			
+				print_view( outstream );
 				if ( cmd != SOCK_CMD_SHOW_AND_QUIT ) break;			
 			/* è' stato richiesto di chiudere la connessione */ 
 			case SOCK_CMD_QUIT: 
 				Log("server <- SOCK_CMD_QUIT",DEBUG, NOPERROR);
-				/* libero la memoria */
+				/* libero la memoria della connessione, l'immagine resta per le prossime patch */
 				if ( buff ) free( buff );
-				if ( matrix ) free( matrix );
 				/* => non devo terminare il processo => retval 0 */
 				return 0; break;	
 			/* Possono esser rivenuti solo i comandi precedenti! */
@@ -142,10 +237,28 @@ int main( int argc, char **argv ){
 	/* assegnazione di default ad outstream ( ridefinita se passato un file ) */
 	FILE *outstream = stdout;
 	
-	/* controllo che non sia stato passato un file come primo argomento*/
-	if ( argc >= 2 && argv[1] )
+	/* leggo la vista richiesta: -w r0,c0,nrow,ncol per una finestra, -d block per la densità */
+	{
+		int opt;
+		view.kind = VIEW_FULL;
+		while ((opt = getopt(argc, argv, "w:d:")) != -1)
+			switch (opt) {
+				case 'w': view.kind = VIEW_WINDOW;
+					if ( sscanf( optarg, "%" SCNd64 ",%" SCNd64 ",%" SCNd64 ",%" SCNd64, &view.r0, &view.c0, &view.nrow, &view.ncol ) != 4 
+					|| view.r0<0 || view.c0<0 || view.nrow<1 || view.ncol<1 )
+						Log("Bad window", FATAL, NOPERROR);
+					break;
+				case 'd': view.kind = VIEW_DENSITY;
+					if ( ( view.block = strtoll( optarg, NULL, 10 ) ) < 1 ) Log("Bad block size", FATAL, NOPERROR);
+					break;
+				default: Log("Bad option", FATAL, NOPERROR); break;
+			}
+	}
+	
+	/* controllo che non sia stato passato un file come argomento*/
+	if ( optind < argc && argv[optind] )
 		/* lo apro come file di dump! */
-		testNull ( outstream = fopen( argv[1], "w+" ) , "FOPEN", PERROR);
+		testNull ( outstream = fopen( argv[optind], "w+" ) , "FOPEN", PERROR);
 	
 	/* inizializzazione dei signal handler */
 	{		
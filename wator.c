@@ -68,9 +68,9 @@
  *				Il motivo è che una coda degli eventi realizzata mediante coda condivisa
  *				potrebbe esser più efficiente di una pipe (non necessaria):
  *					-> Pipe: ogni trasmissione richiederebbe di passare mediante SC
- *					-> Code: in una implementazione migliore rispetto all'attuale
- *						(cioè in cui ad ogni enqueue non corrisponda una malloc)
- *						si avrebbe ovvi vantaggi in performance poichè non si passa da SC
+ *					-> Code: i nodi estratti vengono riusati dalle enqueue successive,
+ *						per cui a regime non c'è nemmeno una malloc:
+ *						si hanno ovvi vantaggi in performance poichè non si passa da SC
  *
  *							DINAMICA DI UNA SINCRONIZZAZIONE:
  *		Sequenza di eventi ( "<--" avrà il significato di "riceve il messaggio" ): 
@@ -168,6 +168,9 @@ void setSignals(){
 	/* Segnali, assegno i vari handler */
 	struct sigaction s; 
 	memset( &s, 0, sizeof(s) );
+	/* le chiamate di sistema interrotte ripartono: nella simulazione divisa tra processi
+	 * è il thread principale a comunicare con slab e visualizer */
+	s.sa_flags = SA_RESTART;
 	s.sa_handler = handler_sigint;
 	testMinus( sigaction( SIGINT, &s, NULL ) , "SIGACTION", PERROR);
 	testMinus( sigaction( SIGTERM, &s, NULL ) , "SIGACTION", PERROR);
@@ -178,18 +181,239 @@ void setSignals(){
 	Log("Signal setted",DEBUG,NOPERROR);
 }
 
+/* processo che sta scrivendo il checkpoint in background, 0 se nessuno */
+static pid_t checkpointer = 0;
+/* catena dei checkpoint incrementali:
+ * chronon della base (-1 se il prossimo checkpoint deve essere completo),
+ * chronon dell'ultimo checkpoint e numero di delta scritti dopo la base */
+static int ckpt_base = -1;
+static int ckpt_last = 0;
+static int ckpt_deltas = 0;
+/* byte dei delta scritti dopo la base */
+static size_t ckpt_chain_len = 0;
+/* rettangoli del prossimo delta, preparati dal padre prima della fork ( presi dall'arena: uno per sotto matrice ) */
+static planet_rect_t *ckpt_rects = NULL;
+
+/** Salva il checkpoint binario completo ( pianeta, btime, dtime, regole, chronon e random ),
+ *	che diventa la base dei delta successivi. Può essere chiamata dal figlio di start_checkpoint:
+ *	non alloca e non stampa, l'errore è riportato dal chiamante.
+ *	Il checkpoint è scritto in un file temporaneo e poi rinominato: un errore o un
+ *	riavvio della macchina durante la scrittura lasciano intatto il checkpoint precedente.
+ *	I delta della base precedente vengono poi eliminati (se l'eliminazione non avviene
+ *	sono comunque scartati al ripristino, poichè riferiti ad un'altra base).
+ *	retval: 0 in caso di successo, -1 altrimenti ( errno settato )
+ */
+int write_checkpoint( wator_t *wat ){
+	sim_state_t state;
+	FILE *f;
+	state.chronon = current_chronon;
+	rng_save( state.rng );
+	if ( save_wator_bin( WATOR_CHECKPOINT_TMP, wat, 1, &state ) || rename( WATOR_CHECKPOINT_TMP, WATOR_CHECKPOINT ) )
+		return -1;
+	if ( ( f = fopen( WATOR_CHECKPOINT_DELTA, "w" ) ) ) fclose( f );
+	return 0;
+}
+
+/** Raccoglie in ckpt_rects le sotto matrici modificate ( celle o tempi ) dopo il chronon since.
+ *	Ogni rettangolo ha un'intestazione ed il proprio riempimento: le sotto matrici modificate
+ *	consecutive sulla stessa riga diventano un solo rettangolo, e le righe intere consecutive anche.
+ *	retval: numero di rettangoli
+ */
+static wide_t dirty_rects( int since, unsigned int ncol ){
+	wide_t t, n = 0;
+	for ( t=0; t<num_of_subs; t++ ){
+		sub_planet_t *sub = sub_planets+t;
+		planet_rect_t *last = ckpt_rects+n-1;
+		if ( sub->stamp <= since && sub->touched <= since ) continue;
+		if ( n && last->row == sub->_row && last->col+last->ncol == sub->_col ){
+			/* prosegue la riga di sotto matrici */
+			last->ncol += sub->_ncol;
+			/* la riga precedente era intera ed anche questa lo è: le unisco */
+			if ( last->ncol == ncol && n > 1 && last[-1].ncol == ncol && last[-1].row+last[-1].nrow == last->row ){
+				last[-1].nrow += last->nrow;
+				n--;
+			}
+			continue;
+		}
+		ckpt_rects[n].row = sub->_row;
+		ckpt_rects[n].col = sub->_col;
+		ckpt_rects[n].nrow = sub->_nrow;
+		ckpt_rects[n].ncol = sub->_ncol;
+		n++;
+	}
+	return n;
+}
+
+/** Aggiunge alla catena della base il delta dei rettangoli rects ( vedi dirty_rects ).
+ *	Come write_checkpoint non alloca e non stampa.
+ *	retval: 0 in caso di successo, -1 altrimenti ( errno settato )
+ */
+int write_delta( wator_t *wat, int base, const planet_rect_t rects[], wide_t n ){
+	sim_state_t state;
+	state.chronon = current_chronon;
+	rng_save( state.rng );
+	return append_wator_delta( WATOR_CHECKPOINT_DELTA, wat, &state, base, rects, n );
+}
+
+/** Scrive il pianeta in formato testuale sul file di check, sovrascrivendolo */
+void write_check( FILE *fd_wator_check, wator_t *wat ){
+	int i,j;
+	/* riposiziono il cursore all'inizio del file => sovrascrittura */
+	rewind(fd_wator_check);
+	/* print */
+	fprintf (fd_wator_check, "%d\n%d\n", wat->plan->nrow, wat->plan->ncol);
+	for (i=0; i<wat->plan->nrow; i++)
+		for (j=0; j<wat->plan->ncol; j++)
+			fprintf(fd_wator_check, "%c%c", 
+				cell_to_char( wat->plan->w[i][j] ), 
+				(j==wat->plan->ncol-1)?'\n':' ' ); 
+	/* fine print */
+	fflush( fd_wator_check );
+}
+
+/** Avvia il dump del file di check e del checkpoint senza fermare la simulazione:
+ *	viene chiamata tra due chronon e crea con fork un processo figlio, il cui spazio di indirizzamento
+ *	è una copia (copy on write) di quello di wator al momento della fork. Il figlio scrive quindi
+ *	un'istantanea coerente mentre il padre procede con il chronon successivo.
+ *	Se il checkpoint precedente non è ancora concluso, questo viene saltato.
+ *	Il checkpoint è un delta con le sole sotto matrici modificate dal precedente, oppure
+ *	un checkpoint completo che fa da nuova base (il primo, dopo un errore, ogni CKPT_MAX_DELTAS
+ *	delta o quando con questo delta la catena occuperebbe più della base: oltre, ripristino
+ *	e disco costerebbero più di un checkpoint completo).
+ *	Con il pianeta su file ( -m ) non c'è copy on write e il checkpoint viene scritto senza fork.
+ */
+void start_checkpoint( FILE *fd_wator_check, wator_t *wat ){
+	pid_t pid;
+	wide_t ndirty;
+	int status, full;
+	if ( checkpointer ){
+		if ( ! waitpid( checkpointer, &status, WNOHANG ) ){
+			Log("Previous checkpoint still running, skipped", DEBUG, NOPERROR);
+			return;
+		}
+		/* se il checkpoint precedente è fallito la catena è interrotta: ne serve uno completo.
+		 * Il figlio non stampa: l'errno dell'errore è il suo stato di uscita */
+		if ( ! WIFEXITED( status ) || WEXITSTATUS( status ) ){
+			errno = WIFEXITED( status ) ? WEXITSTATUS( status ) : EINTR;
+			perror( "writing checkpoint" );
+			ckpt_base = -1;
+		}
+		checkpointer = 0;
+	}
+	/* delta o checkpoint completo: si compatta la catena quando è lunga o il delta è grande */
+	ndirty = dirty_rects( ckpt_last, wat->plan->ncol );
+	full = ckpt_base < 0 || ckpt_deltas >= CKPT_MAX_DELTAS
+		|| ckpt_chain_len + wator_delta_len( ckpt_rects, ndirty ) > wator_bin_len( wat->plan->nrow, wat->plan->ncol, 1, 1 );
+	/* la copy on write non vale per le matrici mappate sul file di appoggio ( MAP_SHARED ):
+	 * il figlio vedrebbe le modifiche del padre, quindi il checkpoint viene scritto qui.
+	 * Lo stesso per le pagine grandi riservate: la copia di una pagina richiede un'altra pagina
+	 * grande libera, se non c'è il kernel la toglie al figlio */
+	if ( planet_backed( wat->plan ) || planet_pages( wat->plan ) >= PLANET_PAGES_2M ){
+		write_check( fd_wator_check, wat );
+		if ( full ? write_checkpoint( wat ) : write_delta( wat, ckpt_base, ckpt_rects, ndirty ) ){
+			perror( "writing checkpoint" );
+			ckpt_base = -1;
+		}
+		else if ( full ){
+			ckpt_base = current_chronon;
+			ckpt_deltas = 0;
+			ckpt_chain_len = 0;
+		}else{
+			ckpt_deltas++;
+			ckpt_chain_len += wator_delta_len( ckpt_rects, ndirty );
+		}
+		ckpt_last = current_chronon;
+		return;
+	}
+	if ( ( pid = fork() ) < 0 ){
+		perror( "checkpoint fork" );
+		return;
+	}
+	if ( pid ){
+		/* padre: la pausa è solo quella della fork */
+		checkpointer = pid;
+		if ( full ){
+			ckpt_base = current_chronon;
+			ckpt_deltas = 0;
+			ckpt_chain_len = 0;
+		}else{
+			ckpt_deltas++;
+			ckpt_chain_len += wator_delta_len( ckpt_rects, ndirty );
+		}
+		ckpt_last = current_chronon;
+		return;
+	}
+	/* figlio: esiste solo questo thread, gli altri sono fermi nella copia.
+	 * Un ctrl-c rivolto a wator non deve interrompere le write a metà */
+	signal( SIGINT, SIG_IGN );
+	signal( SIGUSR1, SIG_IGN );
+	signal( SIGTERM, SIG_DFL );
+	write_check( fd_wator_check, wat );
+	/* _exit per non eseguire la chiusura di wator (visualizer, code, file) né svuotare i buffer
+	 * di stdio copiati dal padre; i rettangoli sono già pronti, quindi qui non si alloca */
+	if ( full ? write_checkpoint( wat ) : write_delta( wat, ckpt_base, ckpt_rects, ndirty ) )
+		_exit( errno ? errno : EXIT_FAILURE );
+	_exit( EXIT_SUCCESS );
+}
+
+/** Ciclo dei chronon della simulazione divisa tra processi ( -P ): sostituisce il ciclo degli eventi,
+ *	il dispacher ed il collector. Tra due comandi gli slab sono fermi, quindi il pianeta ricomposto
+ *	è un'istantanea coerente: i checkpoint sono scritti qui e sono sempre completi.
+ */
+void run_slabs( FILE *fd_wator_check, wator_t *wat ){
+	while ( ! _SIG_EXIT ){
+		if ( _SIG_ALARM ){
+			_SIG_ALARM = 0;
+			Log("Slabs processing alarm", DEBUG, NOPERROR);
+			slab_gather( wat, 1 );
+			write_check( fd_wator_check, wat );
+			if ( write_checkpoint( wat ) ) perror( "writing checkpoint" );
+			alarm ( SEC );
+		}
+		current_chronon++;
+		slab_step( wat );
+		if ( current_chronon % wat->chronon == 0 ){
+			slab_gather( wat, 0 );
+			show_frame( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol, 0 );
+		}
+	}
+	Log("Slabs processing EXIT SIGNAL", DEBUG, NOPERROR);
+	/* l'ultima immagine non può esser scartata */
+	slab_gather( wat, 1 );
+	show_frame( wat->plan->w[0], wat->plan->nrow, wat->plan->ncol, 1 );
+	slab_stop( );
+}
+
 /* ---------------------------------------------------------------------------------- */
 
+/** Posizione sulla curva di Morton ( Z-order ) della cella (r,c): i bit delle due coordinate alternati */
+static uint64_t morton( uint32_t r, uint32_t c ){
+	uint64_t key = 0;
+	int b;
+	for ( b=0; b<32; b++ )
+		key |= ( (uint64_t)( ( r >> b ) & 1 ) << ( 2*b+1 ) ) | ( (uint64_t)( ( c >> b ) & 1 ) << ( 2*b ) );
+	return key;
+}
+
+/** confronta due sotto matrici per posizione sulla curva di Morton della griglia delle sotto matrici ( qsort ) */
+static int cmp_morton( const void *a, const void *b ){
+	wide_t x = *(const wide_t*)a, y = *(const wide_t*)b;
+	uint64_t kx = morton( x / subs_per_row, x % subs_per_row ), ky = morton( y / subs_per_row, y % subs_per_row );
+	return ( kx > ky ) - ( kx < ky );
+}
+
 void initializer ( wator_t *wat ) {
 	/* indici di supporto */
-	int I,J,index = 0;
-	/* conterrà poi la matrice di mutex*/
-	Mutex *mts;
-	/* matrice di stati */
-	cell_state_t *dnm;
-	int area;	
+	wide_t I,J,index = 0;
+	wide_t area;	
 	
 	Log("Init starting...", DEBUG,NOPERROR);
+
+	/* la copia privata di una sotto matrice deve contenere ogni cella una sola volta */
+	if ( speculative && ( wat->plan->nrow < K+2*WEIGHT || wat->plan->ncol < N+2*WEIGHT ) ){
+		fprintf( stderr, "planet too small for speculative updates, using locks\n" );
+		speculative = 0;
+	}
 	
 	/*
 	 *	Global structures
@@ -206,70 +430,88 @@ void initializer ( wator_t *wat ) {
 		/* inizializzo le variabili che segnano un segnale */
 		_SIG_EXIT = 0;
 		_SIG_ALARM = 0;
-		/* ed inizializzo le due code di appoggio, toFree memorizza le cose da rimuovere nella destroy */
-		toFree = queue_create();
-		/* ricorda qualle celle vanno resettate ad ogni update */
-		toClean = sycqueue_create();
 		/* il numero di sotto matrici è dato dal prodotto delle dimensioni divise per K ed N */
-		num_of_subs = top( wat->plan->nrow , K )*top( wat->plan->ncol , N );
-		/* creo l'array di sotto pianeti */
-		sub_planets = testedMalloc ( sizeof( sub_planet_t ) * num_of_subs );
+		subs_per_row = top( wat->plan->ncol , N );
+		num_of_subs = top( wat->plan->nrow , K )*subs_per_row;
+		current_chronon = 0;
+		/* dimensione della matrice originale */
+		area = (wide_t) wat->plan->ncol * wat->plan->nrow;
 	}/* fine inizializzazione variabili globali ^ */
+
+	{/* le strutture che vivono fino alla destroy sono prese da una sola arena, rilasciata in un colpo solo */
+		size_t size = ( sizeof( sub_planet_t ) + 3*sizeof( wide_t ) + sizeof( planet_rect_t ) )*num_of_subs + sizeof( worker_t )*wat->nwork + sizeof( cell_mark_t )*area;
+		size += 2*sizeof( unsigned long )*( num_of_subs/TILE_BITS + 1 );
+		if ( speculative ) size += sizeof( unsigned int )*area;
+		if ( owner_computes ) size += 4*sizeof( *(sub_planets->out) )*num_of_subs;
+		if ( owner_computes || speculative ) size += planet_footprint( K+2*WEIGHT, N+2*WEIGHT )*num_of_subs;
+		if ( cost_order ) size += sizeof( wide_t )*( K*N+1 );
+		/* margine per gli allineamenti */
+		size += 2*CACHE_LINE*( num_of_subs + 8 );
+		if ( planet_file ){
+			/* pianeta su file: anche stati e descrittori, che crescono con il pianeta, stanno su un file
+			 * accanto, altrimenti occuperebbero in memoria più delle celle stesse */
+			char *meta = testedMalloc( strlen( planet_file ) + strlen( WATOR_META_SUFFIX ) + 1 );
+			sprintf( meta, "%s%s", planet_file, WATOR_META_SUFFIX );
+			run_arena = testNull( arena_create_file( meta, size ), "Creating run arena", PERROR );
+			free( meta );
+		}else
+			run_arena = testNull( arena_create( size, size >= HUGE_PAGE ? ARENA_HUGE : 0 ), "Creating run arena", PERROR );
+		/* creo l'array di sotto pianeti */
+		sub_planets = testNull( arena_alloc( run_arena, sizeof( sub_planet_t ) * num_of_subs, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		/* ordine di aggiornamento: per righe oppure lungo la curva di Morton, così sotto matrici consecutive
+		 * sono vicine anche in verticale e condividono righe di cornice ancora in cache */
+		tile_base = testNull( arena_alloc( run_arena, sizeof( wide_t ) * num_of_subs, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		for ( I=0; I<num_of_subs; I++ ) tile_base[I] = I;
+		if ( morton_order ) qsort( tile_base, num_of_subs, sizeof( wide_t ), cmp_morton );
+		/* ordinando per costo il dispacher riscrive ad ogni chronon un ordine a parte */
+		tile_order = tile_base;
+		if ( cost_order ){
+			tile_order = testNull( arena_alloc( run_arena, sizeof( wide_t ) * num_of_subs, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+			cost_buckets = testNull( arena_alloc( run_arena, sizeof( wide_t ) * ( K*N+1 ), CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		}
+		/* rettangoli dei checkpoint incrementali */
+		ckpt_rects = testNull( arena_alloc( run_arena, sizeof( planet_rect_t ) * num_of_subs, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		/* mappe di attività: al primo chronon sono attive tutte, poi solo quelle con animali o in cui ne arrivano */
+		tile_batch = testNull( arena_alloc( run_arena, sizeof( wide_t ) * num_of_subs, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		tile_active = testNull( arena_alloc( run_arena, sizeof( unsigned long )*( num_of_subs/TILE_BITS + 1 ), CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		tile_next = testNull( arena_alloc( run_arena, sizeof( unsigned long )*( num_of_subs/TILE_BITS + 1 ), CACHE_LINE ), "Run arena exhausted", NOPERROR );
+		memset( tile_next, 0xff, sizeof( unsigned long )*( num_of_subs/TILE_BITS + 1 ) );
+	}
 	
+	/* creo una matrice di stati linearizzata: l'arena è appena mappata ( o il suo file appena troncato ),
+	 * quindi è già tutta UNKNOWN e le pagine sono toccate solo dal primo worker che le usa
+	 * ( con le fasce quello che aggiorna la riga, vedi place_band ) */
+	cell_states = testNull( arena_alloc( run_arena, sizeof(cell_mark_t)*area, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+	Log("Allocated state array", DEBUG,NOPERROR);
+
+	/* nella modalità speculativa le celle condivise hanno una versione, inizialmente 0 */
+	cell_versions = NULL;
+	if ( speculative )
+		cell_versions = testNull( arena_alloc( run_arena, sizeof(unsigned int)*area, CACHE_LINE ), "Run arena exhausted", NOPERROR );
+
 	/*
 	 *	Workers
 	 */
 	{/* creo un array di worker */
 		int i;
-		workers = testedMalloc(sizeof(worker_t)*wat->nwork);			
+		/* allineato alla linea di cache, così che ogni worker ne occupi una propria */
+		workers = testNull( arena_alloc( run_arena, sizeof(worker_t)*wat->nwork, CACHE_LINE ), "Run arena exhausted", NOPERROR );
 		/* inizializzo l'array di worker */
 		for( i=0 ; i<wat->nwork ; i++ ){
 			/* memorizzo che worker sia così che esso possa saperlo */
 			workers[i].wid = i;
+			workers[i].dnf = workers[i].dns = 0;
+			workers[i].scratch = testNull( arena_create( SCRATCH_SIZE, 0 ), "Creating worker scratch", PERROR );
+			/* con le fasce ogni worker ha la propria coda di sotto matrici */
+			workers[i].pool = worker_bands ? sycqueue_create() : sm_pool;
 			/* creo il thread e gli passo il proprio descrittore */
 			if ( pthread_create( &(workers[i].thread), NULL, main_worker, & (workers[i].wid) ) )
 				Log("Creating worker", FATAL, NOPERROR);
 		}
 	}/* fine init workers */
 
-	#define VALID_INDEX(i,n) ( (i+n) % (n) )
-	
-	/* dimensione della matrice originale */
-	area = wat->plan->ncol * wat->plan->nrow;
-	/* creo e registro come da liberare, una matrice di stati linearizzata */
-	enqueue( toFree , dnm = testedMalloc(sizeof(cell_state_t)*area) );
-	/* creo una matrice linearizzata di puntatori a mutex come appoggio */
-	mts = testedMalloc( sizeof(Mutex)*area );
-	/* inizializza le nuove matrici */
-	for (I=0;I<area;I++){ mts[I] = NULL; dnm[I] = UNKNOWN; }
-	Log("Allocated mutex array and state array", DEBUG,NOPERROR);
-	
-	/* disegno nella matrice, una serie di cornici di mutex, di spessore 2*WEIGHT */	
-	for( I=0; I<wat->plan->nrow; I+=K ){ /* cornici orizzontali */
-		int j,x;
-		for( x=I-WEIGHT; x<I+WEIGHT; x++){
-			int i=VALID_INDEX( x, wat->plan->nrow );
-			for(j=0; j<wat->plan->ncol; j++)
-				/* oltre che creare la mutex, la inserisco in una coda di roba da deallocare successivamente */
-				enqueue( toFree, mts[i*wat->plan->ncol+j] = testedMalloc(sizeof(pthread_mutex_t)) );
-		}
-	}
-	for ( J=0; J<wat->plan->ncol; J+=N ){ /* cornici verticali */
-		int i,x;
-		for( x=J-WEIGHT; x<J+WEIGHT; x++){
-			int j=VALID_INDEX( x, wat->plan->ncol );
-			for(i=0; i<wat->plan->nrow; i++)
-				if ( ! mts[i*wat->plan->ncol+j] ) /* controllo di non riscrivere su una mutex già creata */
-				/* oltre che creare la mutex, la inserisco in una coda di roba da deallocare successivamente */
-					enqueue( toFree, mts[i*wat->plan->ncol+j] = testedMalloc(sizeof(pthread_mutex_t)) );
-		}
-	}
-	/* inizializzo le mutex */
-	for (I=0;I<area;I++) if(mts[I]) pthread_mutex_init( (mts[I]) ,NULL);
-	Log("Init mutexs done", DEBUG,NOPERROR);
-	/* fine disegno */
-
-	/* inizializzo le sotto matrici */	
+	/* inizializzo le sotto matrici: bastano origine e dimensioni, celle, lock e stati sono calcolati
+	 * dai worker ( vedi cell_at ) */	
 	for( I=0; I<wat->plan->nrow; I+=K )
 		for ( J=0; J<wat->plan->ncol; J+=N ){
 			int i,j;
@@ -278,36 +520,41 @@ void initializer ( wator_t *wat ) {
 			/* definisco la dimensione ( gli estremi: destro, basso ed angolo tra questi due potrebbe avere dimensioni strane )*/
 			sub_plan -> _nrow = MIN( wat->plan->nrow-I , K );
 			sub_plan -> _ncol = MIN( wat->plan->ncol-J , N );
-			/* riempio la sotto matrice con riferimenti alla matrice originale compresi i bordi */
-			for ( i=I-WEIGHT; i< I+sub_plan->_nrow + WEIGHT ; i++ )
-				for ( j=J-WEIGHT; j< J+sub_plan->_ncol + WEIGHT ; j++ ){
-					/* indici all'interno della sottomatrice */
-					int v_i = i-(I-WEIGHT); 
-					int v_j = j-(J-WEIGHT);
-					/* indici reali all'interno della matrice di wator */
-					int r_i = VALID_INDEX( i, wat->plan->nrow );
-					int r_j = VALID_INDEX( j, wat->plan->ncol );
-					/* alias per comodità */
-					real_cell_t * rc = & ( sub_plan->cell[v_i][v_j] );
-					/* ricordo la cella a cui è associata questa meta cella */
-					rc->i = r_i;
-					rc->j = r_j;
-					/* copio un riferimento al contenuto della matrice ( per leggibilità dopo ) */
-					rc->w = & (wat->plan->w[r_i][r_j]);
-					/* gli associo la mutex e lo stato dalle matrici create prima */
-					rc->mutex = mts[ r_i*wat->plan->ncol + r_j ] ;
-					rc->state = dnm+( r_i*wat->plan->ncol + r_j );
-					/* salvo il riferimento */
-					rc->pw = wat;
-				}
+			sub_plan -> _row = I;
+			sub_plan -> _col = J;
+			/* nessun frame è stato ancora inviato: la sotto matrice è da considerarsi cambiata */
+			sub_plan -> stamp = 0;
+			sub_plan -> touched = 0;
+			sub_plan -> enc_valid = 0;
+			sub_plan -> ghost = NULL;
+			if ( owner_computes || speculative ){
+				/* copia privata della sotto matrice con la cornice, sempre in memoria: la prendo dall'arena */
+				int gr = sub_plan->_nrow+2*WEIGHT, gc = sub_plan->_ncol+2*WEIGHT;
+				void *mem = testNull( arena_alloc( run_arena, planet_footprint( gr, gc ), CACHE_LINE ), "Run arena exhausted", NOPERROR );
+				sub_plan -> ghost = testNull( place_planet( mem, gr, gc ), "Creating ghost planet", PERROR );
+			}
+			sub_plan -> out = NULL;
+			/* owner computes: outbox verso i quattro vicini */
+			if ( owner_computes )
+				sub_plan -> out = testNull( arena_alloc( run_arena, 4*sizeof( *(sub_plan->out) ), CACHE_LINE ), "Run arena exhausted", NOPERROR );
+			/* popolazione iniziale della sotto matrice: per owner computes e come primo costo */
+			sub_plan -> nf = sub_plan -> ns = 0;
+			if ( owner_computes || cost_order ){
+				for ( i=I; i<I+sub_plan->_nrow; i++ )
+					for ( j=J; j<J+sub_plan->_ncol; j++ )
+						switch ( wat->plan->w[i][j] ){
+							case FISH: sub_plan->nf++; break;
+							case SHARK: sub_plan->ns++; break;
+							default: break;
+						}
+			}
+			sub_plan -> cost = sub_plan->nf + sub_plan->ns;
 		}
 	Log("Init sub plantets done", DEBUG,NOPERROR);
 	
 	/* da il via al ciclo di update */
 	sycqueue_enqueue( EVENT_QUEUE , (Elem)EVENT_QUEUE_MSG_REQUEST_UPDATE ); 
 	
-	/* libero la matrice di mutex, poichè i riferimenti sono già stati salvati */
-	free(mts);
 	return;
 }
 void destroy() {
@@ -315,21 +562,18 @@ void destroy() {
 		int i;
 		for( i=0 ; i<((wator_t*)syc_wator->sharedItem)->nwork ; i++ )
 			/* ad ogni worker, notifico di terminare */
-			sycqueue_enqueue( sm_pool, (Elem) EVENT_QUEUE_MSG_EXIT );
-		/* aspetto che terminino */
-		for( i=0 ; i<((wator_t*)syc_wator->sharedItem)->nwork ; i++ )
+			sycqueue_enqueue( workers[i].pool, (Elem) EVENT_QUEUE_MSG_EXIT );
+		/* aspetto che terminino e rilascio la loro memoria di lavoro */
+		for( i=0 ; i<((wator_t*)syc_wator->sharedItem)->nwork ; i++ ){
 			if ( pthread_join ( workers[i].thread, NULL ) ) Log("Join w", FATAL, PERROR);
-		/* rilascio l'array di worker */
-		free( workers );
+			arena_destroy( workers[i].scratch );
+			if ( worker_bands ) sycqueue_destroy( workers[i].pool );
+		}
 	} /* fine distruzione workers */
 
-	/* per ogni elemento registrato nella toFree, effettuo la free */
-	while ( isEmpty(toFree) == 0 )
-		free ( dequeue( toFree, NULL ) );
-	/* dealloco l'array, distruggo la coda toFree e quella toClean */
-	free( sub_planets );
-	queue_destroy( toFree );
-	sycqueue_destroy( toClean );
+	/* rilascio in un colpo solo worker, sotto matrici, stati, versioni, copie private ed outbox */
+	arena_destroy( run_arena );
+	locktable_destroy( cell_locks );
 	
 	/* distruggo propriamente le strutture create sulle code globali */
 	sycqueue_destroy( EVENT_QUEUE );
@@ -346,6 +590,10 @@ int main(int argc, char** argv ){
 	int nwork=WORK_DEF, chronon=CHRON_DEF;
 	/* puntatori all'argomento che contiene il nome dei file */
 	char *dumpfile=NULL, *file=NULL;
+	/* checkpoint da cui riprendere la simulazione (opzione -r) */
+	char *resume=NULL;
+	/* stato della simulazione letto dal checkpoint */
+	sim_state_t state;
 	/* file descriptor del file in cui fare il wator_check */
 	FILE *fd_wator_check;
 	/* riferimento al processo che verrà creato */
@@ -354,44 +602,133 @@ int main(int argc, char** argv ){
 	wator_t * wat;
 	/* variabile di escape dall'event loop */
 	Elem END_EVENT_LOOP = 0;	
+	/* politica di consegna dei frame a visualizer */
+	show_policy_t policy = SHOW_POLICY_BLOCK;
+	/* argomenti di visualizer: [-w finestra | -d blocco] [dumpfile] */
+	char *vargv[5];
+	int vargc = 0;
+	/* simulazione divisa tra processi: numero di strisce, porta TCP del coordinatore, coordinatore a cui unirsi */
+	int nslabs = 0;
+	char *slab_port = NULL, *join = NULL;
+	/* tabella dei lock delle celle condivise: tipo e numero di slot */
+	lock_kind_t lock_kind = LOCK_MUTEX;
+	size_t lock_slots = LOCK_SLOTS_DEF;
+	/* pagine richieste per le matrici del pianeta e loro descrizione per il resoconto */
+	planet_pages_t pages = PLANET_PAGES_NORMAL;
+	const char *pages_name[] = { "regular pages", "transparent huge pages", "2MB huge pages", "1GB huge pages" };
 	
 	/* INIZIO INIT */
 	Log("-------- WELCOME ------",DEBUG,NOPERROR);
 	{/* leggo gli argomenti */
 		int opt;
-		while ((opt = getopt(argc, argv, "n:v:f:")) != -1) 
-			/* per ogni opzione tra n,v,f (ognuna con un argomento) */
+		vargv[vargc++] = "visualizer";
+		while ((opt = getopt(argc, argv, "n:abv:f:p:w:d:ezcosL:r:m:H:P:T:J:")) != -1) 
+			/* per ogni opzione tra n,v,f,p,w,d,L,r,m,H,P,T,J (ognuna con un argomento), a, b, e, z, c, o ed s */
 			switch (opt) {
 				/* -n trovata, assegno a nwork la conversione a numero dell'argomento */
 				case 'n': nwork = atoi(optarg); 
 					/* controllo che nwork sia significativo */
 					if (nwork<1) Log("Necessaio almeno un worker",FATAL,NOPERROR);break;
+				/* -a trovata, ogni worker è legato ad una cpu */
+				case 'a': pin_workers = 1; break;
+				/* -b trovata, ogni worker aggiorna sempre la stessa fascia di sotto matrici */
+				case 'b': worker_bands = 1; break;
 				/* -v trovata, assegno a chronon, la conversione a numero dell'argomento */
 				case 'v': chronon = atoi(optarg); 
 					/* controllo che chronon sia significativo */
 					if (chronon<1) Log("Necessaio almeno un chronon",FATAL,NOPERROR);break;
 				/* -f trovata, salvo il riferimento al file di dump */
 				case 'f': dumpfile = optarg; break;
+				/* -p trovata, scelgo la politica di invio dei frame: block, drop o adaptive */
+				case 'p': 
+					switch ( optarg[0] ){
+						case 'b': policy = SHOW_POLICY_BLOCK; break;
+						case 'd': policy = SHOW_POLICY_DROP; break;
+						case 'a': policy = SHOW_POLICY_ADAPTIVE; break;
+						default: fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); break;
+					}
+					break;
+				/* -e trovata, i worker comprimono le sotto matrici durante l'update */
+				case 'e': fused_encoding = 1; break;
+				/* -z trovata, le sotto matrici sono aggiornate lungo la curva di Morton */
+				case 'z': morton_order = 1; break;
+				/* -c trovata, ad ogni chronon le sotto matrici partono dalla più costosa */
+				case 'c': cost_order = 1; break;
+				/* -o trovata, ogni sotto matrice scrive solo nella propria area ( owner computes ) */
+				case 'o': owner_computes = 1; break;
+				/* -s trovata, le sotto matrici sono aggiornate in modo speculativo, senza mutex */
+				case 's': speculative = 1; break;
+				/* -L trovata, tipo dei lock delle celle condivise ed eventualmente numero di slot */
+				case 'L':
+					switch ( optarg[0] ){
+						case 'm': lock_kind = LOCK_MUTEX; break;
+						case 't': lock_kind = LOCK_TICKET; break;
+						case 'b': lock_kind = LOCK_BYTE; break;
+						default: fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); break;
+					}
+					if ( optarg[1] == ',' ) lock_slots = strtoul( optarg+2, NULL, 10 );
+					else if ( optarg[1] ) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+					if ( lock_slots < 1 ) Log("Necessario almeno uno slot di lock",FATAL,NOPERROR);
+					break;
+				/* -r trovata, il pianeta è quello del checkpoint */
+				case 'r': resume = optarg; break;
+				/* -m trovata, le matrici del pianeta saranno mappate sul file indicato */
+				case 'm': set_planet_backing( planet_file = optarg ); break;
+				/* -H trovata, le matrici del pianeta stanno su pagine grandi: transparent, da 2 MB o da 1 GB */
+				case 'H':
+					switch ( optarg[0] ){
+						case 't': pages = PLANET_PAGES_THP; break;
+						case '2': pages = PLANET_PAGES_2M; break;
+						case '1': pages = PLANET_PAGES_1G; break;
+						default: fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); break;
+					}
+					set_planet_pages( pages );
+					break;
+				/* -P trovata, il pianeta è diviso in strisce aggiornate da altrettanti processi */
+				case 'P': nslabs = atoi(optarg);
+					if (nslabs<1) { Log("Necessaria almeno una striscia",FATAL,NOPERROR); }
+					break;
+				/* -T trovata, gli slab si connettono in TCP a questa porta ( avviati con -J ):
+				 * senza indirizzo si ascolta solo sulla macchina locale */
+				case 'T': slab_port = optarg; break;
+				/* -J trovata, questo processo è uno slab del coordinatore indicato */
+				case 'J': join = optarg; break;
+				/* -w o -d trovate: la vista è scelta da visualizer, inoltro l'opzione (una sola) */
+				case 'w': case 'd':
+					if ( vargc > 1 ) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+					vargv[vargc++] = ( opt == 'w' ) ? "-w" : "-d";
+					vargv[vargc++] = optarg;
+					break;
 				/* bad usage */
 				default: fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); break;
 			}
 	}/* fine lettura delle opzioni */
+	/* uno slab riceve tutto dal coordinatore: non ha file, visualizer né segnali da gestire */
+	if ( join ){
+		if (optind < argc) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+		slab_main( join );
+		return EXIT_SUCCESS;
+	}
+	if ( slab_port && ! nslabs ) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+	if ( owner_computes && speculative ) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+	/* ogni slab ha il proprio generatore, che il checkpoint non salva: la ripresa non sarebbe esatta */
+	if ( resume && nslabs ) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
 	/* controllo ci sia almeno un'altro argomento ( deve esserci ) e lo assegno al file */
-	if (optind < argc) file = argv[optind];
+	if ( resume ){
+		/* il checkpoint sostituisce il file del pianeta */
+		if (optind < argc) { fprintf(stderr, HELP_MSG); exit(EXIT_FAILURE); }
+		file = resume;
+	}
+	else if (optind < argc) file = argv[optind];
 	else Log ( "Expected file name", FATAL, NOPERROR);
 	
-	/* verifico la validità dei vari argomenti */
-	{	/* il file di input deve esser conforme al modello di pianeta */	
-		char comand[1025];
-		sprintf(comand, "./watorscript %s 2>/dev/null", file);
-		if ( testMinus( system( comand ) , "Error invoking watorscript", PERROR ) )
-			/* il ritorno del comando è non EXIT_SUCESS => errore */
-			Log("Input file didn't pass the watorscript test", FATAL, NOPERROR );
-		else Log("watorscript test done", DEBUG,NOPERROR);
-	}	/* fine test script */
+	/* verifico la validità dei vari argomenti:
+	 * il file di input viene validato durante il caricamento ( vedi load_planet ) */
+	testMinus ( access(file, R_OK ), file , PERROR );
 
-	/* wator.conf deve essere accedibile in lettura */
-	testMinus ( access(CONFIGURATION_FILE, O_RDONLY ), CONFIGURATION_FILE , PERROR );
+	/* wator.conf deve essere accedibile in lettura (il formato binario contiene già le regole) */
+	if ( ! is_wator_bin( file ) )
+		testMinus ( access(CONFIGURATION_FILE, O_RDONLY ), CONFIGURATION_FILE , PERROR );
 	/* se dumpfile definito allora deve essere accedibile in scrittura */
 	if ( dumpfile ) { 
 		int fd;
@@ -407,12 +744,44 @@ int main(int argc, char** argv ){
 	Log("Controls over the input done", DEBUG,NOPERROR);
 	
 	/* creo wator con file come file da cui attingere la descrizione di planet */
-	wat = testNull( new_wator( file ), "Creating planet", NOPERROR );
+	/* con lo stesso seme di default della libc, ma con uno stato che si può salvare nei checkpoint */
+	rng_init( 1 );
+	/* un pianeta testuale non è un checkpoint */
+	state.chronon = -1;
+	wat = testNull( is_wator_bin( file ) ? load_wator_bin( file, &state ) : new_wator( file ),
+		"Creating planet (is the input file a valid planet?)", NOPERROR );
+	if ( resume ){
+		/* percorso dei delta del checkpoint */
+		char *deltas = testedMalloc( strlen(resume) + strlen(WATOR_DELTA_SUFFIX) + 1 );
+		if ( state.chronon < 0 ) Log( "Resuming from a file that isn't a checkpoint", FATAL, NOPERROR );
+		sprintf( deltas, "%s%s", resume, WATOR_DELTA_SUFFIX );
+		/* la base viene portata all'ultimo delta della catena */
+		testMinus( replay_wator_deltas( deltas, wat, &state ), deltas, PERROR );
+		free( deltas );
+	}
+	/* se sono state richieste pagine grandi dico quali sono state ottenute ( si ripiega su quelle più piccole ) */
+	if ( pages != PLANET_PAGES_NORMAL )
+		fprintf( stderr, "planet storage: %s%s\n", planet_backed( wat->plan ) ? "backing file" : pages_name[ planet_pages( wat->plan ) ],
+			planet_backed( wat->plan ) || planet_pages( wat->plan ) == pages ? "" : " (fallback)" );
 	/* inizializzo i valori nwork e chronon passati come argomenti */
 	wat->nwork = nwork;
 	wat->chronon = chronon;	
-	/* richiedo di inizializzare le sotto matrice sulla base di wat e le variabili globali */
-	initializer ( wat );
+	if ( nslabs ){
+		/* le strisce sono aggiornate dagli slab: nessuna sotto matrice da inizializzare */
+		char addr[SLAB_ADDR_LEN];
+		if ( slab_port ) snprintf( addr, sizeof(addr), "%s%s", strchr( slab_port, ':' ) ? "" : ":", slab_port );
+		slab_start( wat, nslabs, slab_port ? addr : NULL );
+	}else{
+		/* i lock delle celle condivise sono slot di un'unica tabella */
+		cell_locks = testNull( locktable_create( lock_slots, lock_kind ), "Creating lock table", PERROR );
+		/* richiedo di inizializzare le sotto matrice sulla base di wat e le variabili globali */
+		initializer ( wat );
+	}
+	if ( resume ){
+		/* riprendo dal chronon e dalla sequenza casuale del checkpoint */
+		current_chronon = state.chronon;
+		rng_restore( state.rng );
+	}
 	Log("Init done",DEBUG,NOPERROR);
 	/* INIT FINITA */ 
 	
@@ -421,8 +790,10 @@ int main(int argc, char** argv ){
 	testMinus( visualizer = fork(), "Can't Fork", PERROR );	
 	if ( visualizer == 0 ){
 		/* qui sono le figlio => specializzo il processo ad essere visualizer */
-		execl("./visualizer","visualizer", dumpfile,NULL);		
-		/* execl non ha funzionato! */
+		vargv[vargc++] = dumpfile;
+		vargv[vargc] = NULL;
+		execv("./visualizer", vargv);		
+		/* execv non ha funzionato! */
 		testNull( NULL , "EXEC" , PERROR );
 	}
 	/* comunico a visualizer la dimensione della matrice per ridurre la comunicazione dopo */
@@ -433,17 +804,26 @@ int main(int argc, char** argv ){
 	/* Segnali, assegno i vari handler */
 	setSignals();
 	
-	/* creo i thread dispacher e collector */
-	if ( pthread_create( &t_dispacher, NULL, main_dispacher, NULL )) Log("Create thread", FATAL, NOPERROR ); 
-	if ( pthread_create( &t_collector, NULL, main_collector, NULL)) Log("Create thread", FATAL, NOPERROR ); 
-	Log("Thread created",DEBUG,NOPERROR);
+	/* avvio l'eventuale thread di invio dei frame prima del collector che lo usa */
+	show_setup( policy );
+	
+	if ( nslabs ){
+		/* i chronon sono comandati da qui fino al segnale di terminazione: l'event loop non serve */
+		run_slabs( fd_wator_check, wat );
+		END_EVENT_LOOP = (Elem)1;
+	}else{
+		/* creo i thread dispacher e collector */
+		if ( pthread_create( &t_dispacher, NULL, main_dispacher, NULL )) Log("Create thread", FATAL, NOPERROR ); 
+		if ( pthread_create( &t_collector, NULL, main_collector, NULL)) Log("Create thread", FATAL, NOPERROR ); 
+		Log("Thread created",DEBUG,NOPERROR);
+	}
 	
 	/* avvio il timer */
 	/*alarm ( SEC );		*/
 							
 	Log("Starting event loop",DEBUG,NOPERROR);
 	/* event loop */
-	do{
+	while ( !END_EVENT_LOOP ){
 		switch ( (uintptr_t) (sycqueue_dequeue( EVENT_QUEUE )) ) {	
 			/* estraggo un messaggio */
 			case EVENT_QUEUE_MSG_EXIT: 
@@ -477,20 +857,11 @@ int main(int argc, char** argv ){
 					/* continuo la vita di wator */
 					if( _SIG_ALARM ){
 						/* è scattato un allarme, quindi faccio il dump del pianeta sul file di check */
-						int i,j;
 						/* reset di sig_alarm */
 						_SIG_ALARM = 0;
 						Log("EventLoop processing alarm", DEBUG, NOPERROR);
-						/* riposiziono il cursore all'inizio del file => sovrascrittura */
-						rewind(fd_wator_check);
-						/* print */
-						fprintf (fd_wator_check, "%d\n%d\n", wat->plan->nrow, wat->plan->ncol);
-						for (i=0; i<wat->plan->nrow; i++)
-							for (j=0; j<wat->plan->ncol; j++)
-								fprintf(fd_wator_check, "%c%c", 
-									cell_to_char( wat->plan->w[i][j] ), 
-									(j==wat->plan->ncol-1)?'\n':' ' ); 
-						/* fine print */
+						/* il dump e il checkpoint sono scritti in background */
+						start_checkpoint( fd_wator_check, wat );
 						/* richiedo che parta un'allarme tra poco */
 						alarm ( SEC );								
 					}
@@ -505,19 +876,31 @@ int main(int argc, char** argv ){
 			default: Log("EventLoop <- INVALID MSG", DEBUG, NOPERROR); break;
 		}
 	/* ripeto fino a che non ho ricevuto una EXIT request */
-	}while ( !END_EVENT_LOOP );
+	}
 	
 	Log("Event_loop ended",DEBUG,NOPERROR);
 
-	/* chiudo il file di check */
+	/* attendo che l'ultimo checkpoint sia completo, poi chiudo il file di check */
+	if ( checkpointer ) waitpid( checkpointer, NULL, 0 );
 	fclose(fd_wator_check);
 
 	
 	/* epilogo */	
 	/* attendo che i vari thread abbiano terminato dopo avegli inviato l'exit */
-	if ( pthread_join( t_dispacher, NULL ) ) Log("Join", FATAL, NOPERROR);
-	if ( pthread_join( t_collector, NULL ) ) Log("Join", FATAL, NOPERROR);
-	Log("Threads closed", DEBUG,NOPERROR);
+	if ( ! nslabs ){
+		if ( pthread_join( t_dispacher, NULL ) ) Log("Join", FATAL, NOPERROR);
+		if ( pthread_join( t_collector, NULL ) ) Log("Join", FATAL, NOPERROR);
+		Log("Threads closed", DEBUG,NOPERROR);
+	}
+	
+	{	/* il collector ha consegnato l'ultimo frame: fermo il sender e riporto i contatori */
+		show_stats_t st = show_teardown();
+		if ( policy != SHOW_POLICY_BLOCK )
+			fprintf( stderr, "frames: produced %lu, sent %lu, dropped %lu\n", st.produced, st.sent, st.dropped );
+	}
+	if ( speculative )
+		fprintf( stderr, "speculative updates: committed %lu, aborted %lu, locked %lu\n",
+			spec_stats.commits, spec_stats.aborts, spec_stats.fallbacks );
 		
 	/* invio a visualizer la richiesta di terminazione */
 	closeVisualizer();
@@ -525,8 +908,9 @@ int main(int argc, char** argv ){
 	waitpid( visualizer, NULL, 0 );	
 	Log("Visualizer terminated",DEBUG,NOPERROR);
 	
-	/* distruggo ciò che la initializer ha creato */
-	destroy();
+	/* distruggo ciò che la initializer ha creato ( o il solo wator, se diviso tra processi ) */
+	if ( nslabs ) free_wator( wat );
+	else destroy();
 	Log("Destruction done",DEBUG,NOPERROR);
 	
 	/* la terminazione è avvenuta correttamente */
@@ -6,7 +6,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "wator.h"
+#include "core.h"
 
 /** \enum bool
  * 	assume i valori true e false. Serve ad emulare il tipo boolean
@@ -43,41 +50,84 @@ int char_to_cell (char c) {
 }
 
 
-planet_t * new_planet (unsigned int nrow, unsigned int ncol){
-	planet_t *p ;
-	int i;
-	/** area della matrice */
-	int area = nrow * ncol; 
-	/** considero errata la richiesta di una matrice che abbia una dimensione vuota */
-	if ( ! area ) return NULL;
-	
-	/** Per una maggiore facilità di comprensione del codice, per una maggiore semplicità
-	 * 		di trattamento di errori e per evitare un uso massiccio di system call,
-	 * 		la malloc sarà chiamata una sola volta e tutte le infformazioni sul planet saranno contigue.
-	 * 	Assumo che new_planet sia una delle prime funzioni chiamate nel programma,
-	 * 		per cui l'effetto di una serie di malloc dovrebbe avere lo stesso risultato
-	 * 	La suddivisione della memoria allocata sarà esemplificata nei commenti successivi.
-	 *  L'idea è la seguente:
-	 * 		< planet_t >
-	 * 		< vettore di referenze a righe di w>
-	 * 		< vettore di referenze a righe di btime>
-	 * 		< vettore di referenze a righe di dtime>
-	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( w ) >
-	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( btime ) >
-	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( dtime ) >	  	 
-	 * 	Benchè abbiano lo stesso size e siano entrambi int32, verrà distinto tra int ed enum per chiarezza
-	 * 		così come per int* ed enum* che vengono distinti per rendere più leggibile il codice
-	 *  Si stima un'allocamento di sizeof(planet_t) + 3*nrow*sizeof(void*) + 3*nrow*ncol*sizeof(int) 
-	 * */
-	p = malloc(
-		sizeof( planet_t ) 				/* spazio destinato a planet */
-		+ nrow*sizeof( cell_t * ) 		/* spazio destinato a referenziare le righe di w*/
-		+ 2*nrow*sizeof( int * ) 		/* spazio destinato a referenziare le righe di btime e dtime*/
-		+ area*sizeof( cell_t )			/* matrice w */
-		+ 2*area*sizeof( int )			/* matrici btime e dtime */
-	);
-	/** errore di allocazione. */
-	if ( ! p  ) return NULL;
+/** Descrittore che precede planet_t nella memoria allocata da new_planet.
+ *	map è la zona mappata ( sul file di appoggio o su pagine grandi ) che contiene le matrici, NULL se le matrici 
+ *	sono nella stessa malloc del pianeta
+ *	backed indica che map è mappata sul file di appoggio, pages le pagine su cui stanno le matrici
+ *	placed indica che la memoria è del chiamante ( place_planet ) e non va liberata da free_planet
+ */
+typedef struct {
+	void *map;
+	size_t map_len;
+	int backed;
+	planet_pages_t pages;
+	int placed;
+} planet_backing_t;
+
+/* pagine richieste per le matrici dei pianeti creati da new_planet */
+static planet_pages_t planet_pages_req = PLANET_PAGES_NORMAL;
+
+/* file di appoggio per le matrici dei pianeti creati da new_planet, NULL se in memoria */
+static const char *backing_file = NULL;
+
+void set_planet_backing ( const char *file ){
+	backing_file = file;
+}
+
+void set_planet_pages ( planet_pages_t pages ){
+	planet_pages_req = pages;
+}
+
+planet_pages_t planet_pages ( planet_t *p ){
+	return ((planet_backing_t*)p - 1)->pages;
+}
+
+/** Mappa data byte per le matrici di un pianeta sulle pagine più grandi disponibili fino a b->pages,
+ *	e registra in b la zona e le pagine ottenute
+ *	retval: inizio delle matrici, NULL se nemmeno le pagine normali sono disponibili
+ */
+static char *map_huge ( planet_backing_t *b, size_t data ){
+	static const size_t huge_len[] = { 0, 0, HUGE_PAGE, (size_t)1 << 30 };
+	char *map;
+	for ( ; b->pages >= PLANET_PAGES_2M; b->pages-- ){
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+		#ifdef MAP_HUGE_SHIFT
+		/* dimensione esplicita della pagina: log2 */
+		flags |= ( b->pages == PLANET_PAGES_1G ? 30 : 21 ) << MAP_HUGE_SHIFT;
+		#endif
+		b->map_len = ( data + huge_len[b->pages]-1 ) & ~( huge_len[b->pages]-1 );
+		if ( ( map = mmap( NULL, b->map_len, PROT_READ | PROT_WRITE, flags, -1, 0 ) ) != MAP_FAILED )
+			return b->map = map;
+	}
+	/* transparent huge pages ( o pagine normali ): mappo HUGE_PAGE in più per allineare l'inizio delle matrici */
+	b->map_len = data + HUGE_PAGE;
+	if ( ( map = mmap( NULL, b->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) ) == MAP_FAILED ){
+		b->map_len = 0;
+		return NULL;
+	}
+	b->map = map;
+	map = (char*)( ( (uintptr_t)map + HUGE_PAGE-1 ) & ~(uintptr_t)( HUGE_PAGE-1 ) );
+	#ifdef MADV_HUGEPAGE
+	if ( madvise( map, data, MADV_HUGEPAGE ) ) b->pages = PLANET_PAGES_NORMAL;
+	#else
+	b->pages = PLANET_PAGES_NORMAL;
+	#endif
+	return map;
+}
+
+size_t planet_footprint ( unsigned int nrow, unsigned int ncol ){
+	/* vedi lo schema in new_planet */
+	return sizeof( planet_backing_t ) + sizeof( planet_t ) + nrow*sizeof( cell_t * ) + 2*nrow*sizeof( int * )
+		+ (size_t)nrow*ncol*( sizeof( cell_t ) + 2*sizeof( int ) );
+}
+
+/** Dispone pianeta e matrici nella memoria che segue b, come descritto in new_planet
+ *	param map: inizio delle matrici se mappate a parte, NULL se seguono i vettori di righe
+ *	retval: il pianeta, con le matrici inizializzate ad acqua
+ */
+static planet_t * lay_out_planet ( planet_backing_t *b, char *map, unsigned int nrow, unsigned int ncol ){
+	planet_t *p = (planet_t*)( b + 1 );
+	size_t i, area = (size_t)nrow * ncol;
 
 	/** l'allocazione è avvenuta */
 	p->nrow = nrow;
@@ -93,7 +143,7 @@ planet_t * new_planet (unsigned int nrow, unsigned int ncol){
 	p->dtime = (int**)( (p->btime) + nrow );
 
 	/** Inizializzazione dei vettori riga : */
-	p->w [0] = (cell_t*)(p->dtime + nrow);
+	p->w [0] = map ? (cell_t*)map : (cell_t*)(p->dtime + nrow);
 	p->btime[0] = (int*)(p->w[0] + area);
 	p->dtime[0] = (int*)(p->btime[0] + area);
 	for ( i=1; i<nrow; i++ ){
@@ -110,11 +160,129 @@ planet_t * new_planet (unsigned int nrow, unsigned int ncol){
 	return p;
 }
 
+planet_t * place_planet ( void *mem, unsigned int nrow, unsigned int ncol ){
+	planet_backing_t *b = mem;
+	if ( ! b || ! nrow || ! ncol ){
+		errno = EINVAL;
+		return NULL;
+	}
+	b->map = NULL;
+	b->map_len = 0;
+	b->backed = 0;
+	b->pages = PLANET_PAGES_NORMAL;
+	b->placed = 1;
+	return lay_out_planet( b, NULL, nrow, ncol );
+}
+
+int planet_backed ( planet_t *p ){
+	return ((planet_backing_t*)p - 1)->backed;
+}
+
+void planet_advise ( planet_t *p, unsigned int row, unsigned int nrows, int advice ){
+	/* dimensione delle pagine, per allineare l'inizio della zona come richiesto da madvise */
+	static long page = 0;
+	uintptr_t from, to;
+	void **rows[3];
+	int k;
+	if ( ! planet_backed( p ) || row >= p->nrow ) return;
+	if ( row + nrows > p->nrow ) nrows = p->nrow - row;
+	if ( ! page ) page = sysconf( _SC_PAGESIZE );
+	rows[0] = (void**)p->w;
+	rows[1] = (void**)p->btime;
+	rows[2] = (void**)p->dtime;
+	/* le righe di ogni matrice sono contigue */
+	for ( k=0; k<3; k++ ){
+		from = (uintptr_t)rows[k][row] & ~(uintptr_t)(page-1);
+		to = (uintptr_t)rows[k][row] + (size_t)nrows*p->ncol*sizeof(int);
+		madvise( (void*)from, to-from, advice );
+	}
+}
+
+planet_t * new_planet (unsigned int nrow, unsigned int ncol){
+	planet_backing_t *b;
+	/** inizio delle matrici se mappate fuori dalla malloc */
+	char *map = NULL;
+	/** le matrici sono mappate su pagine grandi se richiesto e se il pianeta non è su file */
+	int huge = planet_pages_req != PLANET_PAGES_NORMAL && ! backing_file;
+	/** area della matrice, a 64 bit: nrow*ncol può superare 2^31 */
+	size_t area = (size_t)nrow * ncol; 
+	/** byte occupati dalle tre matrici */
+	size_t data = area*sizeof( cell_t ) + 2*area*sizeof( int );
+	/** considero errata la richiesta di una matrice che abbia una dimensione vuota */
+	if ( ! area ) return NULL;
+	
+	/** Per una maggiore facilità di comprensione del codice, per una maggiore semplicità
+	 * 		di trattamento di errori e per evitare un uso massiccio di system call,
+	 * 		la malloc sarà chiamata una sola volta e tutte le infformazioni sul planet saranno contigue.
+	 * 	Assumo che new_planet sia una delle prime funzioni chiamate nel programma,
+	 * 		per cui l'effetto di una serie di malloc dovrebbe avere lo stesso risultato
+	 * 	La suddivisione della memoria allocata sarà esemplificata nei commenti successivi.
+	 *  L'idea è la seguente:
+	 * 		< planet_backing_t >
+	 * 		< planet_t >
+	 * 		< vettore di referenze a righe di w>
+	 * 		< vettore di referenze a righe di btime>
+	 * 		< vettore di referenze a righe di dtime>
+	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( w ) >
+	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( btime ) >
+	 * 		< vettore rappresentante matrice unidimensionale di dimensione area ( dtime ) >	  	 
+	 * 	Benchè abbiano lo stesso size e siano entrambi int32, verrà distinto tra int ed enum per chiarezza
+	 * 		così come per int* ed enum* che vengono distinti per rendere più leggibile il codice
+	 *  Si stima un'allocamento di sizeof(planet_t) + 3*nrow*sizeof(void*) + 3*nrow*ncol*sizeof(int) 
+	 *	Se è stato indicato un file di appoggio ( set_planet_backing ) le tre matrici non sono allocate
+	 *	con la malloc ma mappate sul file: il kernel tiene in memoria solo le pagine in uso,
+	 *	ed il pianeta può essere più grande della memoria.
+	 *	Allo stesso modo se sono state richieste pagine grandi ( set_planet_pages ) le matrici sono
+	 *	mappate a parte, così da ridurre i TLB miss degli accessi a righe e matrici diverse.
+	 * */
+	size_t size =
+		sizeof( planet_backing_t )		/* descrittore delle matrici */
+		+ sizeof( planet_t ) 				/* spazio destinato a planet */
+		+ nrow*sizeof( cell_t * ) 		/* spazio destinato a referenziare le righe di w*/
+		+ 2*nrow*sizeof( int * ) 		/* spazio destinato a referenziare le righe di btime e dtime*/
+		+ ( backing_file || huge ? 0 : data );		/* matrici w, btime e dtime */
+	b = malloc( size );
+	/** errore di allocazione. */
+	if ( ! b  ) return NULL;
+	b->map = NULL;
+	b->map_len = 0;
+	b->backed = 0;
+	b->pages = PLANET_PAGES_NORMAL;
+	b->placed = 0;
+	if ( huge ){
+		b->pages = planet_pages_req;
+		if ( ! ( map = map_huge( b, data ) ) ){
+			free( b );
+			return NULL;
+		}
+	}
+	if ( backing_file ){
+		int fd = open( backing_file, O_RDWR | O_CREAT, 0666 );
+		/* il file viene portato alla dimensione delle matrici e mappato condiviso: le pagine
+		 * modificate vengono riscritte sul file quando il kernel ha bisogno di memoria */
+		if ( fd < 0 || ftruncate( fd, data ) 
+		|| ( b->map = mmap( NULL, data, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ){
+			if ( fd >= 0 ) close( fd );
+			free( b );
+			return NULL;
+		}
+		close( fd );
+		b->map_len = data;
+		b->backed = 1;
+		map = b->map;
+	}
+	return lay_out_planet( b, map, nrow, ncol );
+}
+
 void free_planet (planet_t* p){
 	/** ATTENZIONE la seguente funzione ha senso solo se planet è stato creato con new_planet!!!!!!
-	 *  In base alla funzione sopra citata lo spazzio allocato è unico e contiguo.
+	 *  In base alla funzione sopra citata lo spazzio allocato è unico e contiguo,
+	 *	a parte le matrici mappate sul file di appoggio.
+	 *	Un pianeta creato con place_planet sta nella memoria del chiamante, che la rilascia.
 	 * */	
-	free(p);
+	planet_backing_t *b = (planet_backing_t*)p - 1;
+	if ( b->map ) munmap( b->map, b->map_len );
+	if ( ! b->placed ) free(b);
 }
 
 int print_planet (FILE* f, planet_t* p){
@@ -146,26 +314,196 @@ int print_planet (FILE* f, planet_t* p){
 	#endif
 }
 
-planet_t* load_planet (FILE* f){
+/** Il file del pianeta viene mappato in memoria e diviso in pezzi, ognuno analizzato da un thread.
+ *	Le regole di validazione sono quelle di watorscript:
+ *		- le prime due righe contengono solo un intero (nrow e ncol)
+ *		- seguono esattamente nrow righe, ognuna di esattamente ncol caratteri tra F,S,W separati da spazi o tab
+ *	Come nel vecchio caricamento con fscanf, l'ultima riga può non terminare con un fine riga.
+ *	Uno stream che non è un file regolare ( o che non si riesce a mappare ) è letto in sequenza con fscanf.
+ *	Un pezzo più piccolo di LOAD_CHUNK_MIN byte non giustifica la creazione di un thread
+ */
+#define LOAD_CHUNK_MIN (1<<20)
+#define LOAD_MAX_THREADS 64
+
+/** Pezzo di file assegnato ad un thread del caricamento */
+typedef struct {
+	const char *from; /* primo carattere, sempre ad inizio riga */
+	const char *to; /* primo carattere escluso */
+	planet_t *p;
+	int row; /* indice della prima riga del pezzo */
+	int nrows; /* righe contenute nel pezzo */
+	bool ok; /* esito dell'analisi */
+} load_chunk_t;
+
+/** Legge un intero occupante da solo una riga dell'intestazione.
+ *	param pos: inizio della riga, al ritorno inizio della riga successiva
+ *	param end: fine del file
+ *	retval: l'intero letto, -1 se la riga non è valida
+ */
+static long read_header_int( const char **pos, const char *end ){
+	const char *c = *pos;
+	long v = 0;
+	int digits = 0;
+	while ( c<end && ( *c==' ' || *c=='\t' ) ) c++;
+	while ( c<end && *c>='0' && *c<='9' && v<=(long)(~0u>>1) ){
+		v = v*10 + (*c++ - '0');
+		digits++;
+	}
+	while ( c<end && ( *c==' ' || *c=='\t' ) ) c++;
+	if ( ! digits || c==end || *c!='\n' ) return -1;
+	*pos = c+1;
+	return v;
+}
+
+/** Conta le righe del pezzo: il pezzo termina con un fine riga, tranne eventualmente l'ultimo */
+static void *count_chunk( void *arg ){
+	load_chunk_t *ch = arg;
+	const char *c = ch->from;
+	ch->nrows = 0;
+	while ( c<ch->to && ( c = memchr( c, '\n', ch->to-c ) ) ){
+		ch->nrows++;
+		c++;
+	}
+	/* ultima riga senza fine riga */
+	if ( ch->to>ch->from && ch->to[-1]!='\n' ) ch->nrows++;
+	return NULL;
+}
+
+/** Analizza le righe del pezzo scrivendole nella matrice, a partire dalla riga ch->row */
+static void *parse_chunk( void *arg ){
+	load_chunk_t *ch = arg;
+	const char *c = ch->from;
+	int i, j;
+	int cell;
+	ch->ok = FALSE;
+	for ( i=ch->row; i<ch->row+ch->nrows; i++ ){
+		for ( j=0; ; j++ ){
+			while ( c<ch->to && ( *c==' ' || *c=='\t' ) ) c++;
+			if ( c==ch->to || *c=='\n' ) break;
+			/* ogni cella è un solo carattere tra quelli ammessi, seguito da un separatore */
+			if ( j==ch->p->ncol || ( cell = char_to_cell( *c ) ) < 0 ) return NULL;
+			c++;
+			if ( c<ch->to && *c!=' ' && *c!='\t' && *c!='\n' ) return NULL;
+			ch->p->w[i][j] = cell;
+		}
+		if ( j != ch->p->ncol ) return NULL;
+		/* salto il fine riga */
+		c++;
+	}
+	ch->ok = TRUE;
+	return NULL;
+}
+
+/** Esegue fun su tutti i pezzi, uno per thread (il primo nel thread chiamante)
+ *	retval: 0 se tutti i thread sono stati creati, -1 altrimenti
+ */
+static int run_chunks( void *(*fun)(void*), load_chunk_t *chunks, int n ){
+	pthread_t tid[LOAD_MAX_THREADS];
+	int i, created, err = 0;
+	for ( created=1; created<n; created++ )
+		if ( pthread_create( tid+created, NULL, fun, chunks+created ) ) { err = -1; break; }
+	fun( chunks );
+	for ( i=1; i<created; i++ )
+		pthread_join( tid[i], NULL );
+	return err;
+}
+
+/** Caricamento sequenziale con fscanf, per gli stream che non si possono mappare ( pipe, terminale, ... )
+ *	Lascia lo stream subito dopo l'ultima cella letta
+ */
+static planet_t* load_planet_stream (FILE* f){
 	planet_t *p ;
 	char c;
-	int nr, nc, i, j;
+	int nr, nc, i, j, cell;
 	/* la lettura di numeri negativi è considerata errata */
-	if ( fscanf(f,"%d\n%d\n", &nr, &nc) != 2 || nr<0 || nc <0 ){
+	if ( fscanf(f,"%d\n%d\n", &nr, &nc) != 2 || nr<0 || nc <0 || ! ( p = new_planet( nr, nc ) ) ){
 		errno = ERANGE;
 		return NULL;
 	}
-	p = new_planet( nr, nc );
 	for (i=0; i<nr; i++)
 		for (j=0; j<nc; j++)
 			/* per ogni cella mi aspetto di leggere esattamente e solo il carattere o poi uno spazio o un endline*/
 			if ( fscanf( f, (j==nc-1) ? "%c\n" : "%c " , &c ) != 1 
-			|| ( p->w[i][j] = char_to_cell(c) ) == '?' ){
+			|| ( cell = char_to_cell(c) ) < 0 ){
 				errno = ERANGE;
 				/* libero la memoria */
 				free_planet( p );
 				return NULL;
-			}
+			}else
+				p->w[i][j] = cell;
+	return p;
+}
+
+planet_t* load_planet (FILE* f){
+	planet_t *p = NULL;
+	struct stat st;
+	const char *map, *pos, *end, *c;
+	long nr, nc, off;
+	load_chunk_t chunks[LOAD_MAX_THREADS];
+	int n, i, rows;
+	bool ok;
+	
+	/* solo un file regolare può essere mappato: gli altri stream sono letti in sequenza */
+	if ( fstat( fileno(f), &st ) || ! S_ISREG( st.st_mode ) || ( off = ftell(f) ) < 0 )
+		return load_planet_stream( f );
+	/* il file viene letto dalla posizione corrente */
+	if ( st.st_size <= off ){
+		errno = ERANGE;
+		return NULL;
+	}
+	if ( ( map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0 ) ) == MAP_FAILED )
+		return load_planet_stream( f );
+	/* la lettura è sequenziale: il kernel può anticipare le pagine */
+	madvise( (void*)map, st.st_size, MADV_SEQUENTIAL );
+	pos = map + off;
+	end = map + st.st_size;
+
+	/* intestazione: la lettura di numeri negativi è considerata errata */
+	if ( ( nr = read_header_int( &pos, end ) ) < 0 || ( nc = read_header_int( &pos, end ) ) < 0 
+	|| ! ( p = new_planet( nr, nc ) ) ){
+		munmap( (void*)map, st.st_size );
+		errno = ERANGE;
+		return NULL;
+	}
+
+	/* numero di pezzi: uno per processore, ma non più piccoli di LOAD_CHUNK_MIN */
+	n = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( n > (end-pos)/LOAD_CHUNK_MIN ) n = (end-pos)/LOAD_CHUNK_MIN;
+	if ( n > LOAD_MAX_THREADS ) n = LOAD_MAX_THREADS;
+	if ( n < 1 ) n = 1;
+	/* i confini dei pezzi sono spostati all'inizio della riga successiva */
+	for ( i=0; i<n; i++ ){
+		chunks[i].p = p;
+		chunks[i].nrows = 0;
+		chunks[i].from = ( i==0 ) ? pos : chunks[i-1].to;
+		c = pos + (end-pos)/n*(i+1);
+		if ( i==n-1 || c<chunks[i].from ) c = end;
+		else if ( ( c = memchr( c, '\n', end-c ) ) ) c++;
+		else c = end;
+		chunks[i].to = c;
+	}
+
+	/* prima passata: righe di ogni pezzo, da cui l'indice della prima riga di ciascuno */
+	ok = ! run_chunks( count_chunk, chunks, n );
+	for ( i=0, rows=0; i<n; i++ ){
+		chunks[i].row = rows;
+		rows += chunks[i].nrows;
+	}
+	/* devono esserci esattamente nrow righe */
+	ok = ok && rows == nr;
+	/* seconda passata: analisi e copia delle celle */
+	ok = ok && ! run_chunks( parse_chunk, chunks, n );
+	for ( i=0; ok && i<n; i++ )
+		ok = chunks[i].ok;
+
+	munmap( (void*)map, st.st_size );
+	if ( ! ok ){
+		free_planet( p );
+		errno = ERANGE;
+		return NULL;
+	}
+	/* le righe arrivano fino alla fine del file: lo stream riparte da lì, come dopo la lettura con fscanf */
+	fseek( f, st.st_size, SEEK_SET );
 	return p;
 }
 
@@ -470,7 +808,8 @@ int fish_rule4 (wator_t* pw, int x, int y, int *k, int* l){
 /******************************************* counters ***************************************************/
 
 int count ( planet_t * p , cell_t e ) {
-	int i, r = 0;
+	size_t i;
+	int r = 0;
 	if ( ! p ) {
 		/* unico caso di errore */
 		errno = EFAULT;
@@ -479,7 +818,7 @@ int count ( planet_t * p , cell_t e ) {
 	/* per ogni cella di tutta l'area controllo 
 	 * Da notare che secondo le assunzioni di new_planet, la matrice è contigua!
 	 * */
-	for ( i = p->nrow * p->ncol -1 ; i>= 0 ; i-- )
+	for ( i = (size_t)p->nrow * p->ncol ; i-- > 0 ; )
 	/* incremento r di 1 se e ed p->w[0][i] sono uguali
 	 * */
 		r += ! ( e - p->w[0][i] );
@@ -512,20 +851,21 @@ int update_wator (wator_t * pw){
 	int *stm[2], ns=0;
 	int *ftm[2], nf=0;
 	int i,j, trash_i, trash_j;
-	stm[0]=stm[1]=ftm[0]=ftm[1] = NULL;
-	/* alloco e se c'è qualche errore rimuovo tutto. */
-	if ( ! pw 
-	|| ! ( stm[0] = malloc (sizeof(int)*pw->ns) )
-	|| ! ( stm[1] = malloc (sizeof(int)*pw->ns) )
-	|| ! ( ftm[0] = malloc (sizeof(int)*pw->nf) ) 
-	|| ! ( ftm[1] = malloc (sizeof(int)*pw->nf) ) ) {
-		if ( stm[0] ) free ( stm[0] );
-		if ( ftm[0] ) free ( ftm[0] );
-		if ( stm[1] ) free ( stm[1] );
-		if ( ftm[1] ) free ( ftm[1] );
+	/* un solo blocco per le quattro righe, liberato ad ogni uscita */
+	int *buf;
+	if ( ! pw || pw->ns < 0 || pw->nf < 0 ) {
 		errno = EFAULT;
 		return -1;
 	}
+	/* due righe per gli squali e due per i pesci ( almeno un int: malloc(0) può dare NULL ) */
+	if ( ! ( buf = malloc( sizeof(int)*( 2*( (size_t)pw->ns + pw->nf ) + 1 ) ) ) ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	stm[0] = buf;
+	stm[1] = stm[0] + pw->ns;
+	ftm[0] = stm[1] + pw->ns;
+	ftm[1] = ftm[0] + pw->nf;
 	/* la scansione degli animali da muovere avviene prima di muoverli per evitare di muovere due volte lo stesso animale*/
 	for (i=0; i<pw->plan->nrow; i++)
 		for (j=0; j<pw->plan->ncol; j++)
@@ -533,10 +873,7 @@ int update_wator (wator_t * pw){
 				default : break;
 				case SHARK:
 					if ( ns == pw->ns ) { /* ATTENZIONE STATO INCONSISTENTE !!! trovati più shark di quanti dovrebbe*/
-						free ( stm[0] );
-						free ( ftm[0] );
-						free ( stm[1] );
-						free ( ftm[1] );
+						free ( buf );
 						errno = EBADF;
 						return -1;
 					}
@@ -546,10 +883,7 @@ int update_wator (wator_t * pw){
 					break;
 				case FISH:
 					if ( nf == pw->nf ) { /* ATTENZIONE STATO INCONSISTENTE !!! trovati più fish di quanti dovrebbe*/
-						free ( stm[0] );
-						free ( ftm[0] );
-						free ( stm[1] );
-						free ( ftm[1] );
+						free ( buf );
 						errno = EBADF;
 						return -1;
 					}
@@ -574,10 +908,7 @@ int update_wator (wator_t * pw){
 		if ( pw->plan->w [ftm[0][i]][ftm[1][i]] == FISH ) 
 			fish_rule3( pw, ftm[0][i], ftm[1][i], &trash_i, &trash_j );
 	/* è passato un chronon */
-	free ( stm[0] );
-	free ( ftm[0] );
-	free ( stm[1] );
-	free ( ftm[1] );
+	free ( buf );
 	return 0;
 }
 
@@ -3,6 +3,7 @@
 	Si dichiara che il contenuto di questo file e' in ogni sua parte opera
 	originale dell' autore.  */
 #include "main_header.h"
+#include <sys/syscall.h>
 
 /* enumeratore che rappresenterà il movimento dell'animale */
 typedef enum{
@@ -37,63 +38,262 @@ direction_t find_dir( int i, int j, int fi, int fj ) {
 	}
 }
 
-/** Essenzialmente una map sull'array close di lunghezza d
- *	param close: array su cui fare la map
+/** Riporta l'indice x ( che può uscire di WEIGHT ) nell'intervallo [0,n) del toro */
+static wide_t wrap( wide_t x, wide_t n ){
+	return ( x + n ) % n;
+}
+
+int shared_cell( planet_t *p, wide_t i, wide_t j ){
+	/* le celle condivise sono righe e colonne, spesse 2*WEIGHT, a cavallo dei bordi delle sotto matrici
+	 * ( sul toro, anche tra l'ultima e la prima ) */
+	return ( i+WEIGHT ) % K < 2*WEIGHT || i >= p->nrow-WEIGHT
+		|| ( j+WEIGHT ) % N < 2*WEIGHT || j >= p->ncol-WEIGHT;
+}
+
+real_cell_t cell_at( sub_planet_t *sub, int I, int J ){
+	planet_t *p = ((wator_t*)syc_wator->sharedItem)->plan;
+	real_cell_t rc;
+	wide_t index;
+	int shared;
+	/* posizione nel pianeta */
+	rc.i = wrap( sub->_row + I - WEIGHT, p->nrow );
+	rc.j = wrap( sub->_col + J - WEIGHT, p->ncol );
+	index = (wide_t)rc.i*p->ncol + rc.j;
+	rc.w = &(p->w[rc.i][rc.j]);
+	rc.state = cell_states + index;
+	/* lock e versione solo per le celle condivise ( in owner computes nessuna cella è scritta da due worker ) */
+	shared = shared_cell( p, rc.i, rc.j );
+	rc.slot = ( shared && ! owner_computes ) ? locktable_slot( cell_locks, index ) : NULL;
+	rc.version = ( shared && cell_versions ) ? cell_versions + index : NULL;
+	return rc;
+}
+
+/** Prende i lock delle celle condivise dell'array close di lunghezza d
+ *	param close: celle del rombo
  *	param d: dimenzione di close 
- *	param fun: funzione da applicare 
- *	ATTENZIONE : 
- *		lo scopo è solo fare la lock o la unlock 
- */
-void do_on_cells( real_cell_t* close[], int d, void(*fun)(Mutex) ){
-	/* OSSERVAZIONE : le lock sono fatte sempre nel solito ordine.
-	 * I FILOSOFI : non è possibile la deadlock perchè le lock fatte sono
-	 *  in ordine ed inoltre l'area lockata non occupa tutta la sub matrix 
-	 *	per cui al massimo 3 sotto matrici possono avere dell'area inusabile.
-	 *	non è dunque possibile che ogni sotto matrice sia in attesa di qualche dun altra
+ *	param slots: array di almeno d elementi, riempito con gli slot presi ( da passare a unlock_cells )
+ *	retval: numero di slot presi
+ */
+int lock_cells( real_cell_t close[], int d, lock_slot_t* slots[] ){
+	/* OSSERVAZIONE : le lock sono fatte sempre in ordine di slot.
+	 * I FILOSOFI : non è possibile la deadlock perchè ogni worker prende gli slot in ordine
+	 *	crescente, e due celle del rombo che condividono uno slot lo prendono una sola volta
 	 */
 	int i;
 	for ( i=0; i<d; i++ )
-		if ( close[i]->mutex )
-			fun( close[i]->mutex );	
+		slots[i] = close[i].slot;
+	return locktable_lock_all( cell_locks, slots, d );
+}
+
+/** Rilascia gli n slot presi da lock_cells */
+void unlock_cells( lock_slot_t* slots[], int n ){
+	locktable_unlock_all( cell_locks, slots, n );
 }
 
-/** versione safe di un incremento di un contatore di wator.
- *	param ref: puntatore al contatore da variare
+/* descrittore del worker che esegue il thread corrente */
+static __thread worker_t *self;
+
+/** Memoria di lavoro per la sotto matrice in corso, presa dall'arena del worker corrente
+ *	e scartata quando il worker passa alla sotto matrice successiva ( vedi main_worker )
+ *	param size: byte richiesti
+ */
+static void *scratch( size_t size ){
+	return testNull( arena_alloc( self->scratch, size, CACHE_LINE ), "Worker scratch exhausted", NOPERROR );
+}
+
+/** Variazione del numero di animali di un tipo nel chronon in corso.
+ *	Non serve alcun lock: la variazione è accumulata nel descrittore del worker corrente
+ *	e sommata ai contatori di wator dal collector, a chronon concluso.
+ *	param type: FISH o SHARK
  *	param value: quanto modificare il contatore
  */
-void inc_ref( int *ref, int value ){
-	/* entro in una zona safe da race condition per evitare che due thread applichino
-	 * una modifica allo stesso contatore contemporanemanete
-	*/
-	syc_lock(syc_wator); 
-	/*safe*/
-	/* modifico il contatore */
-	*ref=*ref+value; 
-	syc_unlock(syc_wator);
+void inc_ref( cell_t type, int value ){
+	if ( type == FISH ) self->dnf += value;
+	else self->dns += value;
 }
 
-/**	Inizializza l'array close preallocato con il rombo avente centro in I,J su c
+/** Marca come cambiata nel chronon corrente una sotto matrice
+ *	Più worker possono scrivere lo stesso valore sullo stesso stamp: la scrittura è idempotente
+ *	e viene letta dal collector solo a chronon concluso.
+ *	L'invalidazione dell'immagine compressa avviene dopo la modifica della cella (release),
+ *	così il worker proprietario che la comprime (vedi encode_slot) o se ne accorge o vede la modifica.
+ *	param sub: sotto matrice modificata
+ */
+void stamp_sub( sub_planet_t *sub ){
+	sub->stamp = current_chronon;
+	__atomic_store_n( &(sub->enc_valid), 0, __ATOMIC_RELEASE );
+}
+
+/** Marca come cambiata la sotto matrice che possiede la cella rc
+ *	param rc: cella modificata (anche appartenente alla cornice)
+ */
+void mark_changed( real_cell_t *rc ){
+	wide_t t = (rc->i/K)*subs_per_row + rc->j/N;
+	stamp_sub( sub_planets + t );
+	/* un animale arrivato ( o nato ) nella sotto matrice la rende attiva */
+	wake_tile( t );
+}
+
+/** Segna la sotto matrice di indice t da aggiornare nel prossimo chronon
+ *	I worker accendono soltanto i bit di tile_next: li spegne il dispacher, a chronon concluso.
+ *	La lettura preliminare evita di contendere la parola quando il bit è già acceso.
+ *	param t: indice in sub_planets
+ */
+void wake_tile( wide_t t ){
+	unsigned long *word = tile_next + t/TILE_BITS, bit = 1UL << ( t%TILE_BITS );
+	if ( ! ( __atomic_load_n( word, __ATOMIC_RELAXED ) & bit ) )
+		__atomic_fetch_or( word, bit, __ATOMIC_RELAXED );
+}
+
+int encode_sub( sub_planet_t *sub, bits_t *dest ){
+	/* celle della sotto matrice copiate in modo contiguo per comprimerle */
+	cell_t tile[K*N];
+	planet_t *plan = ((wator_t*)syc_wator->sharedItem)->plan;
+	int i,j;
+	for ( i=0; i<sub->_nrow; i++ )
+		for ( j=0; j<sub->_ncol; j++ )
+			tile[i*sub->_ncol+j] = plan->w[sub->_row+i][sub->_col+j];
+	return compress( dest, tile, sub->_nrow*sub->_ncol );
+}
+
+/** Codifica fusa: comprime la sotto matrice appena aggiornata, mentre è ancora in cache.
+ *	Un vicino potrebbe modificarne il bordo più tardi nello stesso chronon: in quel caso
+ *	enc_valid torna a 0 (vedi stamp_sub) ed il collector la ricomprimerà alla show.
+ *	param sub: sotto matrice appena aggiornata
+ */
+void encode_slot( sub_planet_t *sub ){
+	/* la validità è dichiarata prima di leggere le celle: lo scambio sincronizza
+	 * con l'eventuale invalidazione di un vicino già avvenuta */
+	__atomic_exchange_n( &(sub->enc_valid), 1, __ATOMIC_SEQ_CST );
+	sub->enc_bits = encode_sub( sub, sub->enc );
+}
+
+/**	Inizializza l'array close preallocato con il rombo avente centro in I,J su sub
  *	param close: array da riempire 
  *	param (I,J): posizione intorno alla quale tracciare il rombo
- *	param c: matrice sulla quale disegnare il rombo
+ *	param sub: sotto matrice sulla quale disegnare il rombo
  */
-void do_assign_round ( real_cell_t* close[], int I, int J, real_cell_t c[][N+2*WEIGHT] ){
+void do_assign_round ( real_cell_t close[], int I, int J, sub_planet_t *sub ){
 	int i,j,index=0,d;
 	/* piccolo check, poichè la funzione si presta ad adattarsi qualora WEIGHT diventasse due ( moviemento e poi riproduzione )*/
 	if ( WEIGHT != 1 ) Log ("ATTENZIONE : do assign round fatta supponendo WEIGHT 1", FATAL, NOPERROR );
 	/* disegno effettivamente il rombo */
 	for ( i=I-WEIGHT, d=0; i<=I+WEIGHT; i++, d = WEIGHT - abs(I-i) )
 		for ( j=J - d ; j<=J + d ; j++ )
-			close[index++] = &( c[i][j] );
+			close[index++] = cell_at( sub, i, j );
 }
 
 
+/** Aggiorna l'animale nella cella (I,J) della sotto matrice
+ *	Il chiamante garantisce che nessun altro worker operi sul rombo centrato in (I,J)
+ *	param sub_plan: sotto pianeta su cui operare
+ *	param (I,J): indici della cella all'interno della sotto matrice ( cornice compresa )
+ */
+static void update_cell( sub_planet_t *sub_plan, int I, int J ){
+	wator_t *wat = (wator_t*)syc_wator->sharedItem;
+	real_cell_t rc = cell_at( sub_plan, I, J ), *cell = &rc;
+	if ( * (cell->w) != WATER && STATE_OF( *(cell->state) ) == UNKNOWN ){ 
+		/* se lo stato è UNKNOWN ( o di un chronon precedente ) allora la cella non è stata mossa da nessuno */
+		sub_plan->cost++;
+		int i= cell->i;
+		int j= cell->j;
+		/* indici all'interno della sotto matrice */
+		int v_i,v_j;
+		/* cella di arrivo del figlio o dell'animale */
+		real_cell_t to;
+		direction_t dir;
+		/* temine del movimento */
+		int dest_i = i, dest_j = j;
+		/* posizione dei figli */
+		int son_i = i, son_j = j;
+		/* osservo quale animale sia */
+		cell_t type = *(cell->w);
+		/* flag se mi dice se è morto di vecchiaiai */
+		int dead = 0;
+		
+		/* le regole aggiornano almeno btime o dtime: serve al checkpoint incrementale */
+		sub_plan->touched = current_chronon;
+		
+		/* applico le regole, verificando che non ci siano errori */
+		if ( type == FISH ) { 
+			testMinus( fish_rule4( wat, i, j, &son_i, &son_j ), "Applaying fish rule 4", NOPERROR);
+			testMinus( fish_rule3( wat, i, j, &dest_i, &dest_j ), "Applaying fish rule 3", NOPERROR);
+		}else{ /* SHARK */
+			int action ;
+			/* guardo lo squalo sia morto */
+			dead = DEAD==testMinus( shark_rule2( wat, i, j, &son_i, &son_j ), "Applaying shark rule 2", NOPERROR);
+			if ( ! dead ) {
+				/* lo squalo è ancora in vita, quindi lo muovo */
+				action = testMinus( shark_rule1( wat, i, j, &dest_i, &dest_j ), "Applaying shark rule 1", NOPERROR);				
+				if ( action == EAT ) /* se ha mangiato devo ridurre il numero dei pesci */
+					inc_ref( FISH, -1 );
+			}
+		}
+		
+		/* guardo se effettivamente un figlio sia nato */
+		if ( son_i != i || son_j != j ) {
+			/* scopro in che posizione sia stato messo e setto lo stato nella cella corrispondente */
+			dir = find_dir( i,j, son_i,son_j );
+			v_i = I + ( dir == SUD ) - ( dir == NORD );
+			v_j = J + ( dir == EST ) - ( dir == OVEST );
+			to = cell_at( sub_plan, v_i, v_j );
+			if ( dir != CENTRO ) *(to.state) = STATE_MARK( CREATED );
+			/* incremento il contatore che conta quell'animale */
+			inc_ref( type, +1 );
+			/* il figlio può esser nato in una sotto matrice vicina */
+			mark_changed( &to );
+		}
+		
+		/* se l'animale non è morto ( il pesce mai, lo squalo potrebbe )*/
+		if ( ! dead ){
+			/* trovo la cella virtuale in cui è finito lo squalo e cambio lo stato */
+			dir = find_dir( i,j, dest_i,dest_j );
+			v_i = I + ( dir == SUD ) - ( dir == NORD );
+			v_j = J + ( dir == EST ) - ( dir == OVEST );
+			to = cell_at( sub_plan, v_i, v_j );
+			if ( dir != CENTRO ) *(to.state) = STATE_MARK( MOVED );
+			/* l'animale si è mosso: cambiano la cella di partenza e quella di arrivo */
+			if ( dest_i != i || dest_j != j ){
+				stamp_sub( sub_plan );
+				mark_changed( &to );
+			}
+		}else{
+			/* diminuisco il contatore degli squali, poichè uno è morto */
+			inc_ref( SHARK, -1 );
+			stamp_sub( sub_plan );
+		}
+	}
+}
+
+/** Aggiorna la cella (I,J) dopo aver preso i lock del rombo centrato in essa
+ *	param sub_plan: sotto pianeta su cui operare
+ *	param (I,J): indici della cella all'interno della sotto matrice
+ */
+static void locked_cell( sub_planet_t *sub_plan, int I, int J ){
+	/* creo un array di supporto di celle che mi rappresentano il rombo */
+	/* la casistica è fatta per cambiare agevolmente l'ordine delle regole */
+	const int dim = (WEIGHT==1)?5:13;
+	real_cell_t close[(WEIGHT==1)?5:13];
+	lock_slot_t* slots[(WEIGHT==1)?5:13];
+	int n;
+	/* le inizializzo e poi effettuo la lock */
+	do_assign_round ( close, I, J, sub_plan );
+	n = lock_cells( close, dim, slots );
+	/* safe */
+	update_cell( sub_plan, I, J );
+	unlock_cells( slots, n );
+	/* unsafe */
+}
+
 /** Nuova versione di update wator che non opera sull'intera matrice ma solo su un sub_planet
+ *	Le celle il cui rombo non tocca celle condivise ( sono su due righe e due colonne a cavallo
+ *	di ogni bordo ) sono aggiornate senza lock: nelle righe interne formano il tratto [lo,hi)
  *	param sub_plan: sotto pianeta su cui operare
  */
 void sub_update_wator( sub_planet_t *sub_plan ){
 	int I, J;
-	real_cell_t *cell;
+	/* colonne delle celle interne, valide per le righe interne */
+	const int lo = 3*WEIGHT, hi = MAX( lo, sub_plan->_ncol-WEIGHT );
 	
 	/* per rispettare il secondo frammento, non effettuo l'update */
 	#ifdef _DO_NOT_UPDATE_
@@ -102,95 +302,445 @@ void sub_update_wator( sub_planet_t *sub_plan ){
 	
 	/* per ogni riga della sotto matrice (area viola + gialla indiata nella documentazione) */
 	for(I=WEIGHT; I<sub_plan->_nrow+WEIGHT; I++)
-		/* e per ogni colonna, sempre nell'area di proprietà di questa sotto matrice */
-		for( J=WEIGHT; J<sub_plan->_ncol+WEIGHT; J++ ){
-			/* creo un array di supporto di celle che mi rappresentano il rombo */
-			/* la casistica è fatta per cambiare agevolmente l'ordine delle regole */
-			const int dim = (WEIGHT==1)?5:13;
-			real_cell_t* close[(WEIGHT==1)?5:13];
-			/* le inizializzo e poi effettuo la lock */
-			do_assign_round ( close, I, J, sub_plan->cell );
-			do_on_cells( close, dim , lock );
-			/* safe */
-			cell = &(sub_plan->cell[I][J]);
-			if ( * (cell->w) != WATER && *(cell->state) == UNKNOWN ){ 
-				/* se lo stato è UNKNOWN allora la cella non è stata mossa da nessuno */
-				int i= cell->i;
-				int j= cell->j;
-				/* indici all'interno della sotto matrice */
-				int v_i,v_j;
-				/* temine del movimento */
-				int dest_i = i, dest_j = j;
-				/* posizione dei figli */
-				int son_i = i, son_j = j;
-				/* osservo quale animale sia */
-				cell_t type = *(cell->w);
-				/* flag se mi dice se è morto di vecchiaiai */
-				int dead = 0;
-				
-				/* applico le regole, verificando che non ci siano errori */
-				if ( type == FISH ) { 
-					testMinus( fish_rule4( cell->pw, i, j, &son_i, &son_j ), "Applaying fish rule 4", NOPERROR);
-					testMinus( fish_rule3( cell->pw, i, j, &dest_i, &dest_j ), "Applaying fish rule 3", NOPERROR);
-				}else{ /* SHARK */
-					int action ;
-					/* guardo lo squalo sia morto */
-					dead = DEAD==testMinus( shark_rule2( cell->pw, i, j, &son_i, &son_j ), "Applaying shark rule 2", NOPERROR);
-					if ( ! dead ) {
-						/* lo squalo è ancora in vita, quindi lo muovo */
-						action = testMinus( shark_rule1( cell->pw, i, j, &dest_i, &dest_j ), "Applaying shark rule 1", NOPERROR);				
-						if ( action == EAT ) /* se ha mangiato devo ridurre il numero dei pesci */
-							inc_ref( &(cell->pw->nf) , -1 );
-					}
+		if ( I >= 3*WEIGHT && I < sub_plan->_nrow-WEIGHT ){
+			/* riga interna: le celle condivise sono solo agli estremi */
+			for( J=WEIGHT; J<lo; J++ ) locked_cell( sub_plan, I, J );
+			for( ; J<hi; J++ ) update_cell( sub_plan, I, J );
+			for( ; J<sub_plan->_ncol+WEIGHT; J++ ) locked_cell( sub_plan, I, J );
+		}else
+			/* riga di bordo: ogni rombo tocca celle condivise */
+			for( J=WEIGHT; J<sub_plan->_ncol+WEIGHT; J++ )
+				locked_cell( sub_plan, I, J );
+}
+
+
+/*
+ *	OWNER COMPUTES ( -o )
+ *	Ogni sotto matrice scrive solo nella propria area, per cui non servono lock.
+ *	Un chronon è diviso in due fasi separate dal collector:
+ *		owner_update aggiorna una copia privata della sotto matrice con la cornice ( il pianeta è solo letto )
+ *			e raccoglie negli outbox gli animali che ne escono;
+ *		owner_apply ricopia la copia privata nel pianeta, libera o ripristina le celle di partenza
+ *			degli animali usciti ed accetta quelli arrivati dai vicini.
+ *	Nella seconda fase copie private ed outbox sono solo letti: un arrivo è accettato se la cella
+ *	( aggiornata ) è acqua o se uno squalo trova un pesce; se più animali arrivano sulla stessa cella
+ *	decide l'ordine fisso delle direzioni. L'esito è così lo stesso per chi parte e per chi riceve.
+ */
+
+/** Direzione opposta a d */
+static direction_t opposite( direction_t d ){
+	switch ( d ){
+		case NORD: return SUD;
+		case SUD: return NORD;
+		case OVEST: return EST;
+		case EST: return OVEST;
+		default: return CENTRO;
+	}
+}
+
+/** Sotto matrice vicina di sub nella direzione d ( il pianeta è un toro ) */
+static sub_planet_t *neighbour( sub_planet_t *sub, direction_t d ){
+	wide_t rows = num_of_subs / subs_per_row;
+	wide_t r = sub->_row / K, c = sub->_col / N;
+	switch ( d ){
+		case NORD: r = ( r + rows - 1 ) % rows; break;
+		case SUD: r = ( r + 1 ) % rows; break;
+		case OVEST: c = ( c + subs_per_row - 1 ) % subs_per_row; break;
+		case EST: c = ( c + 1 ) % subs_per_row; break;
+		default: break;
+	}
+	return sub_planets + r*subs_per_row + c;
+}
+
+/** Decide se la sotto matrice to accetta l'arrivo mv
+ *	param to: sotto matrice che possiede la cella di arrivo
+ *	param mv: animale uscito da un vicino di to
+ *	retval: 1 se accettato, 0 altrimenti
+ */
+static int owner_accepts( sub_planet_t *to, const ghost_move_t *mv ){
+	/* contenuto della cella dopo la prima fase di to */
+	cell_t c = to->ghost->w[ mv->i - to->_row + WEIGHT ][ mv->j - to->_col + WEIGHT ];
+	direction_t d;
+	int k, ok;
+	/* gli arrivi sulla stessa cella sono considerati nell'ordine delle direzioni */
+	for ( d=NORD; d<=EST; d++ ){
+		sub_planet_t *from = neighbour( to, d );
+		for ( k=0; k<from->nout[ opposite(d) ]; k++ ){
+			const ghost_move_t *o = from->out[ opposite(d) ] + k;
+			if ( o->i != mv->i || o->j != mv->j ) continue;
+			ok = c == WATER || ( o->cell == SHARK && c == FISH );
+			if ( o == mv ) return ok;
+			if ( ok ) c = o->cell;
+		}
+	}
+	return 0;
+}
+
+/** Scrive un animale nella cella (i,j) del pianeta */
+static void put_cell( planet_t *p, int i, int j, cell_t cell, int btime, int dtime ){
+	p->w[i][j] = cell;
+	p->btime[i][j] = btime;
+	p->dtime[i][j] = dtime;
+}
+
+/** Applica le regole agli animali della copia privata di sub, come sub_update_wator
+ *	param sub: sotto matrice la cui copia privata ( ghost ) è già stata riempita
+ *	param state: stati delle celle della copia privata
+ *	param hold: se vero, la cella di partenza di un animale che esce dalla sotto matrice resta occupata
+ *	param dnf, dns: variazione del numero di pesci e squali
+ */
+static void ghost_rules( sub_planet_t *sub, cell_state_t state[][N+2*WEIGHT], int hold, int *dnf, int *dns ){
+	/* le regole operano su una copia di wator che ha come pianeta la copia privata */
+	wator_t local = *(wator_t*)syc_wator->sharedItem;
+	planet_t *g = sub->ghost;
+	int I, J;
+	local.plan = g;
+	for ( I=WEIGHT; I<sub->_nrow+WEIGHT; I++ )
+		for ( J=WEIGHT; J<sub->_ncol+WEIGHT; J++ )
+			if ( g->w[I][J] != WATER && state[I][J] == UNKNOWN ){
+				int dest_i = I, dest_j = J, son_i = I, son_j = J, dead = 0;
+				cell_t type = g->w[I][J];
+				sub->touched = current_chronon;
+				sub->cost++;
+				if ( type == FISH ){
+					testMinus( fish_rule4( &local, I, J, &son_i, &son_j ), "Applaying fish rule 4", NOPERROR);
+					testMinus( fish_rule3( &local, I, J, &dest_i, &dest_j ), "Applaying fish rule 3", NOPERROR);
+				}else{
+					dead = DEAD==testMinus( shark_rule2( &local, I, J, &son_i, &son_j ), "Applaying shark rule 2", NOPERROR);
+					if ( ! dead && EAT == testMinus( shark_rule1( &local, I, J, &dest_i, &dest_j ), "Applaying shark rule 1", NOPERROR) )
+						(*dnf)--;
+				}
+				if ( son_i != I || son_j != J ){
+					state[son_i][son_j] = CREATED;
+					if ( type == FISH ) (*dnf)++; else (*dns)++;
 				}
-				
-				/* guardo se effettivamente un figlio sia nato */
-				if ( son_i != i || son_j != j ) {
-					switch ( find_dir( i,j, son_i,son_j ) ){
-						/* scopro in che posizione sia stato messo e setto lo stato nella cella corrispondente */
-						case NORD:	*(sub_plan->cell[v_i = I-1][v_j = J].state) = CREATED; break;								
-						case SUD:	*(sub_plan->cell[v_i = I+1][v_j = J].state) = CREATED; break;								
-						case EST:	*(sub_plan->cell[v_i = I][v_j = J+1].state) = CREATED; break;								
-						case OVEST:	*(sub_plan->cell[v_i = I][v_j = J-1].state) = CREATED; break;
-						default : v_i=I; v_j=J; break;												
-					}				
-					/* incremento il contatore che conta quell'animale */
-					inc_ref( ((type==FISH)?&(cell->pw->nf):&(cell->pw->ns)) , +1 );
-					/* se è in un area condivisa, delego al collector di pulire l'etichetta */
-					if ( sub_plan->cell[v_i][v_j].mutex ) sycqueue_enqueue( toClean, sub_plan->cell[v_i][v_j].state );
+				if ( dead ) (*dns)--;
+				else {
+					state[dest_i][dest_j] = MOVED;
+					/* uscito dalla sotto matrice: finchè il vicino non lo accetta la cella di partenza
+					 * resta occupata, così nessun altro animale vi si sposta */
+					if ( hold && ( dest_i < WEIGHT || dest_i >= sub->_nrow+WEIGHT || dest_j < WEIGHT || dest_j >= sub->_ncol+WEIGHT ) )
+						g->w[I][J] = SHARK;
 				}
-				
-				/* se l'animale non è morto ( il pesce mai, lo squalo potrebbe )*/
-				if ( ! dead ){
-					switch ( find_dir( i,j, dest_i,dest_j ) ){
-						/* trovo la cella virtuale in cui è finito lo squalo e cambio lo stato */
-						case NORD:	*(sub_plan->cell[v_i = I-1][v_j = J].state) = MOVED; break;								
-						case SUD:	*(sub_plan->cell[v_i = I+1][v_j = J].state) = MOVED; break;								
-						case EST:	*(sub_plan->cell[v_i = I][v_j = J+1].state) = MOVED; break;								
-						case OVEST:	*(sub_plan->cell[v_i = I][v_j = J-1].state) = MOVED; break;
-						default : v_i=I; v_j=J; break;												
-					}
-					/* delego al collector di pulire lo stato se in un area condivisa */
-					if ( sub_plan->cell[v_i][v_j].mutex ) sycqueue_enqueue( toClean, sub_plan->cell[v_i][v_j].state );
-				}else
-					/* diminuisco il contatore degli squali, poichè uno è morto */
-					inc_ref( &(cell->pw->ns) , -1 );
 			}
-			do_on_cells( close, dim , unlock );
-			/* unsafe */
+}
+
+/** Prima fase: aggiorna la copia privata di sub e ne riempie gli outbox
+ *	param sub: sotto matrice da aggiornare
+ */
+static void owner_update( sub_planet_t *sub ){
+	planet_t *p = ((wator_t*)syc_wator->sharedItem)->plan, *g = sub->ghost;
+	cell_state_t (*state)[N+2*WEIGHT] = scratch( sizeof(cell_state_t[K+2*WEIGHT][N+2*WEIGHT]) );
+	int I, J, dnf = 0, dns = 0;
+	direction_t d;
+
+	/* copio sotto matrice e cornice, azzerando gli stati */
+	for ( I=0; I<g->nrow; I++ )
+		for ( J=0; J<g->ncol; J++ ){
+			real_cell_t c = cell_at( sub, I, J ), *rc = &c;
+			put_cell( g, I, J, *(rc->w), p->btime[rc->i][rc->j], p->dtime[rc->i][rc->j] );
+			state[I][J] = UNKNOWN;
+		}
+
+	/* aggiorno gli animali della sotto matrice ( i contatori sono ricalcolati nella seconda fase ) */
+	ghost_rules( sub, state, 1, &dnf, &dns );
+
+	/* le celle della cornice su cui è arrivato qualcosa sono gli outbox: ognuna confina
+	 * con una sola cella della sotto matrice, da cui è partito l'animale */
+	for ( d=NORD; d<=EST; d++ ) sub->nout[d] = 0;
+	for ( I=0; I<g->nrow; I++ )
+		for ( J=0; J<g->ncol; J++ )
+			if ( state[I][J] != UNKNOWN && ( I < WEIGHT || I >= sub->_nrow+WEIGHT || J < WEIGHT || J >= sub->_ncol+WEIGHT ) ){
+				ghost_move_t *mv;
+				real_cell_t to = cell_at( sub, I, J );
+				real_cell_t from = cell_at( sub, MIN( MAX( I, WEIGHT ), sub->_nrow ), MIN( MAX( J, WEIGHT ), sub->_ncol ) );
+				d = ( I < WEIGHT ) ? NORD : ( I >= sub->_nrow+WEIGHT ) ? SUD : ( J < WEIGHT ) ? OVEST : EST;
+				mv = sub->out[d] + sub->nout[d]++;
+				mv->i = to.i;
+				mv->j = to.j;
+				mv->oi = from.i;
+				mv->oj = from.j;
+				mv->cell = g->w[I][J];
+				mv->btime = g->btime[I][J];
+				mv->dtime = g->dtime[I][J];
+				mv->moved = state[I][J] == MOVED;
+			}
+	/* i vicini con arrivi dovranno applicarli anche se non hanno animali propri */
+	for ( d=NORD; d<=EST; d++ )
+		if ( sub->nout[d] ) wake_tile( neighbour( sub, d ) - sub_planets );
+}
+
+/** Seconda fase: pubblica la copia privata di sub e vi applica gli esiti degli outbox
+ *	param sub: sotto matrice aggiornata nella prima fase
+ */
+static void owner_apply( sub_planet_t *sub ){
+	wator_t *wat = (wator_t*)syc_wator->sharedItem;
+	planet_t *p = wat->plan, *g = sub->ghost;
+	int I, J, k, changed = 0, nf = 0, ns = 0;
+	direction_t d;
+
+	/* ricopio la copia privata nella mia area */
+	for ( I=WEIGHT; I<sub->_nrow+WEIGHT; I++ )
+		for ( J=WEIGHT; J<sub->_ncol+WEIGHT; J++ ){
+			real_cell_t c = cell_at( sub, I, J ), *rc = &c;
+			if ( *(rc->w) != g->w[I][J] ) changed = 1;
+			put_cell( p, rc->i, rc->j, g->w[I][J], g->btime[I][J], g->dtime[I][J] );
+		}
+
+	/* animali usciti: se il vicino li ha accettati la cella di partenza si libera, altrimenti tornano indietro */
+	for ( d=NORD; d<=EST; d++ )
+		for ( k=0; k<sub->nout[d]; k++ ){
+			const ghost_move_t *mv = sub->out[d] + k;
+			if ( ! mv->moved ) continue;
+			if ( owner_accepts( neighbour( sub, d ), mv ) ) put_cell( p, mv->oi, mv->oj, WATER, 0, 0 );
+			else put_cell( p, mv->oi, mv->oj, mv->cell, mv->btime, mv->dtime );
+			changed = 1;
+		}
+
+	/* animali arrivati dai vicini ( i nati rifiutati non nascono ) */
+	for ( d=NORD; d<=EST; d++ ){
+		sub_planet_t *from = neighbour( sub, d );
+		for ( k=0; k<from->nout[ opposite(d) ]; k++ ){
+			const ghost_move_t *mv = from->out[ opposite(d) ] + k;
+			if ( owner_accepts( sub, mv ) ){
+				put_cell( p, mv->i, mv->j, mv->cell, mv->btime, mv->dtime );
+				changed = 1;
+			}
+		}
+	}
+	if ( changed ) stamp_sub( sub );
+
+	/* i contatori di wator variano di quanto è variata la popolazione della sotto matrice */
+	for ( I=WEIGHT; I<sub->_nrow+WEIGHT; I++ )
+		for ( J=WEIGHT; J<sub->_ncol+WEIGHT; J++ )
+			switch ( p->w[sub->_row+I-WEIGHT][sub->_col+J-WEIGHT] ){
+				case FISH: nf++; break;
+				case SHARK: ns++; break;
+				default: break;
+			}
+	if ( nf != sub->nf ) inc_ref( FISH, nf - sub->nf );
+	if ( ns != sub->ns ) inc_ref( SHARK, ns - sub->ns );
+	sub->nf = nf;
+	sub->ns = ns;
+}
+
+
+/*
+ *	SPECULATIVO ( -s )
+ *	Le celle condivise con i vicini hanno un numero di versione, pari se libera e dispari mentre
+ *	un worker la sta scrivendo. Il worker legge le versioni della sotto matrice e della cornice,
+ *	aggiorna una copia privata e la pubblica solo se nessuna versione è cambiata: le acquisisce
+ *	tutte ( da v a v+1 ) senza attendere, scrive, e le rilascia a v+2 se la cella è cambiata, a v altrimenti.
+ *	Dopo SPEC_RETRIES tentativi annullati acquisisce le versioni attendendo, in ordine di indirizzo
+ *	( come un lock ), prima di leggere: quell'aggiornamento non può fallire.
+ */
+
+/** Legge una versione, attendendo che nessuno la stia scrivendo */
+static unsigned int version_read( unsigned int *ver ){
+	unsigned int v;
+	while ( ( v = __atomic_load_n( ver, __ATOMIC_ACQUIRE ) ) & 1 ) sched_yield();
+	return v;
+}
+
+/** Acquisisce una versione letta in precedenza: fallisce se nel frattempo è cambiata */
+static int version_try( unsigned int *ver, unsigned int v ){
+	return __atomic_compare_exchange_n( ver, &v, v+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED );
+}
+
+/** confronta due versioni per indirizzo ( qsort ) */
+static int cmp_version( const void *a, const void *b ){
+	unsigned int *x = *(unsigned int* const*)a, *y = *(unsigned int* const*)b;
+	return ( x > y ) - ( x < y );
+}
+
+/** Un tentativo di aggiornamento speculativo di sub
+ *	param sub: sotto matrice da aggiornare
+ *	param locked: se vero le versioni sono acquisite prima di leggere ( il tentativo non fallisce )
+ *	retval: 1 se pubblicato, 0 se una cella letta è stata cambiata da un vicino
+ */
+static int spec_update( sub_planet_t *sub, int locked ){
+	wator_t *wat = (wator_t*)syc_wator->sharedItem;
+	planet_t *p = wat->plan, *g = sub->ghost;
+	cell_state_t (*state)[N+2*WEIGHT] = scratch( sizeof(cell_state_t[K+2*WEIGHT][N+2*WEIGHT]) );
+	unsigned int **vers = scratch( sizeof(unsigned int*)*(K+2*WEIGHT)*(N+2*WEIGHT) );
+	unsigned int *seen = scratch( sizeof(unsigned int)*(K+2*WEIGHT)*(N+2*WEIGHT) );
+	int I, J, k, nvers = 0, dnf = 0, dns = 0, changed = 0;
+
+	/* versioni delle celle condivise della sotto matrice e della cornice, in ordine di indirizzo */
+	for ( I=0; I<g->nrow; I++ )
+		for ( J=0; J<g->ncol; J++ ){
+			real_cell_t rc = cell_at( sub, I, J );
+			if ( rc.version ) vers[nvers++] = rc.version;
 		}
-	/* ripulisco gli stati se le celle sono in zone non condivise (area gialla della documentazione) */
-	for(I=WEIGHT*2; I<sub_plan->_nrow; I++)
-		for( J=WEIGHT*2; J<sub_plan->_ncol; J++ )
-			if ( sub_plan->cell[I][J].mutex == NULL ) /* per esser sicuro che non siano in zone condivise (inutile) */
-				*(sub_plan->cell[I][J].state) = UNKNOWN;
+	qsort( vers, nvers, sizeof(unsigned int*), cmp_version );
+	/* versioni lette, o acquisite se il tentativo non deve fallire */
+	for ( k=0; k<nvers; k++ ){
+		seen[k] = version_read( vers[k] );
+		if ( locked && ! version_try( vers[k], seen[k] ) ) k--;
+	}
+	/* copia privata, compresi gli stati delle celle condivise */
+	for ( I=0; I<g->nrow; I++ )
+		for ( J=0; J<g->ncol; J++ ){
+			real_cell_t c = cell_at( sub, I, J ), *rc = &c;
+			put_cell( g, I, J, *(rc->w), p->btime[rc->i][rc->j], p->dtime[rc->i][rc->j] );
+			state[I][J] = rc->version ? STATE_OF( *(rc->state) ) : UNKNOWN;
+		}
+
+	ghost_rules( sub, state, 0, &dnf, &dns );
+
+	/* validazione: acquisisco le versioni lette, se una è cambiata rinuncio */
+	if ( ! locked )
+		for ( k=0; k<nvers; k++ )
+			if ( ! version_try( vers[k], seen[k] ) ){
+				while ( k-- ) __atomic_store_n( vers[k], seen[k], __ATOMIC_RELEASE );
+				return 0;
+			}
+
+	/* pubblico le celle cambiate: la loro versione avanzerà di 2 */
+	for ( I=0; I<g->nrow; I++ )
+		for ( J=0; J<g->ncol; J++ ){
+			real_cell_t c = cell_at( sub, I, J ), *rc = &c;
+			int mine = I >= WEIGHT && I < sub->_nrow+WEIGHT && J >= WEIGHT && J < sub->_ncol+WEIGHT;
+			int dirty = 0;
+			if ( ! mine && ! rc->version ) continue;
+			if ( *(rc->w) != g->w[I][J] || p->btime[rc->i][rc->j] != g->btime[I][J] || p->dtime[rc->i][rc->j] != g->dtime[I][J] ){
+				put_cell( p, rc->i, rc->j, g->w[I][J], g->btime[I][J], g->dtime[I][J] );
+				if ( mine ) changed = 1; else mark_changed( rc );
+				dirty = 1;
+			}
+			/* lo stato di una cella condivisa dice ai vicini che l'animale è già stato aggiornato:
+			 * anche lui fa avanzare la versione */
+			if ( rc->version && STATE_OF( *(rc->state) ) != state[I][J] ){
+				*(rc->state) = STATE_MARK( state[I][J] );
+				dirty = 1;
+			}
+			if ( dirty && rc->version ) *(rc->version) += 2;
+		}
+	for ( k=0; k<nvers; k++ )
+		__atomic_store_n( vers[k], *(vers[k]) - 1, __ATOMIC_RELEASE );
+	if ( changed ) stamp_sub( sub );
+	if ( dnf ) inc_ref( FISH, dnf );
+	if ( dns ) inc_ref( SHARK, dns );
+	return 1;
+}
+
+/** Aggiornamento speculativo di sub: se un vicino ha cambiato le celle lette riprova,
+ *	dopo SPEC_RETRIES tentativi aggiorna tenendo acquisite le versioni
+ *	param sub: sotto matrice da aggiornare
+ */
+static void spec_update_wator( sub_planet_t *sub ){
+	int t;
+	for ( t=0; t<SPEC_RETRIES; t++ ){
+		/* ogni tentativo riparte dalla stessa memoria di lavoro */
+		arena_reset( self->scratch );
+		if ( spec_update( sub, 0 ) ){
+			__atomic_fetch_add( &(spec_stats.commits), 1, __ATOMIC_RELAXED );
+			return;
+		}
+		__atomic_fetch_add( &(spec_stats.aborts), 1, __ATOMIC_RELAXED );
+	}
+	arena_reset( self->scratch );
+	spec_update( sub, 1 );
+	__atomic_fetch_add( &(spec_stats.fallbacks), 1, __ATOMIC_RELAXED );
+}
+
+/***************************************************************************************/
+/*
+ *	FASCE ED AFFINITÀ
+ *	Con -b le righe di sotto matrici sono divise in nwork fasce contigue, una per worker:
+ *	ogni worker aggiorna solo la propria, per cui le righe del pianeta, gli stati e le versioni
+ *	che tocca stanno sul nodo NUMA della sua cpu ( -a lo lega ad una cpu ).
+ */
+
+/* parole della maschera di cpu di sched_getaffinity e sched_setaffinity ( fino a 1024 cpu ) */
+#define CPU_WORDS ( 1024 / ( 8*sizeof(unsigned long) ) )
+/* flag di move_pages: sposta le pagine usate solo da questo processo */
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1<<1)
+#endif
+/* pagine spostate da una chiamata a move_pages */
+#define MOVE_CHUNK (512)
+
+/** Fascia della sotto matrice sub */
+static int band_of( sub_planet_t *sub ){
+	wator_t *wat = (wator_t*)syc_wator->sharedItem;
+	return (int)( ( sub->_row / K ) * wat->nwork / top( wat->plan->nrow, K ) );
+}
+
+SycQueue tile_pool( sub_planet_t *sub ){
+	return worker_bands ? workers[ band_of( sub ) ].pool : sm_pool;
+}
+
+/** Lega il thread corrente alla wid-esima ( ciclicamente ) delle cpu su cui il processo può girare */
+static void pin_worker( int wid ){
+	unsigned long mask[CPU_WORDS], mine[CPU_WORDS];
+	const int bits = 8*sizeof(unsigned long);
+	long len, cpu, ncpu = 0, k;
+	memset( mask, 0, sizeof(mask) );
+	/* la chiamata di sistema restituisce i byte della maschera del kernel */
+	if ( ( len = syscall( SYS_sched_getaffinity, 0, sizeof(mask), mask ) ) <= 0 ) return;
+	for ( cpu=0; cpu<8*len; cpu++ ) ncpu += ( mask[cpu/bits] >> (cpu%bits) ) & 1;
+	if ( ! ncpu ) return;
+	for ( k = wid % ncpu, cpu=0; cpu<8*len; cpu++ )
+		if ( ( ( mask[cpu/bits] >> (cpu%bits) ) & 1 ) && k-- == 0 ) break;
+	memset( mine, 0, sizeof(mine) );
+	mine[cpu/bits] = 1UL << (cpu%bits);
+	if ( syscall( SYS_sched_setaffinity, 0, sizeof(mine), mine ) ) Log("Pinning worker", DEBUG, PERROR);
+}
+
+/** Prima scrittura delle pagine di [addr, addr+len) da parte del thread corrente: le assegna al suo nodo
+ *	Le scritture lasciano i valori invariati, per cui altri worker possono già lavorare sulla zona
+ */
+static void touch_pages( unsigned int *addr, size_t len ){
+	size_t k, step = sysconf( _SC_PAGESIZE ) / sizeof(unsigned int);
+	for ( k=0; k<len; k+=step ) __atomic_fetch_add( addr+k, 0, __ATOMIC_RELAXED );
+	if ( len ) __atomic_fetch_add( addr+len-1, 0, __ATOMIC_RELAXED );
+}
+
+/** Sposta le pagine di [addr, addr+len) sul nodo node ( non fa niente su un sistema senza NUMA ) */
+static void move_to_node( void *addr, size_t len, int node ){
+	void *pages[MOVE_CHUNK];
+	int nodes[MOVE_CHUNK], status[MOVE_CHUNK], n = 0;
+	uintptr_t page = sysconf( _SC_PAGESIZE ), from = (uintptr_t)addr & ~( page-1 ), to = (uintptr_t)addr + len;
+	for ( ; from < to; from += page ){
+		pages[n] = (void*)from;
+		nodes[n] = node;
+		if ( ++n == MOVE_CHUNK || from + page >= to ){
+			if ( syscall( SYS_move_pages, 0, (unsigned long)n, pages, nodes, status, MPOL_MF_MOVE ) ) return;
+			n = 0;
+		}
+	}
 }
 
+/** Porta sul nodo NUMA del thread corrente la memoria della fascia wid:
+ *	stati e versioni sono appena mappati e vengono toccati per primi da qui,
+ *	le righe del pianeta sono già state scritte da chi lo ha caricato e vengono spostate
+ */
+static void place_band( int wid ){
+	wator_t *wat = (wator_t*)syc_wator->sharedItem;
+	planet_t *p = wat->plan;
+	wide_t rows = top( p->nrow, K );
+	wide_t from = top( wid*rows, wat->nwork )*K, to = MIN( top( (wid+1)*rows, wat->nwork )*K, p->nrow );
+	size_t cells = ( to - from )*p->ncol;
+	unsigned int cpu, node;
+	if ( from >= to ) return;
+	touch_pages( cell_states + from*p->ncol, cells );
+	if ( cell_versions ) touch_pages( cell_versions + from*p->ncol, cells );
+	if ( syscall( SYS_getcpu, &cpu, &node, NULL ) ) return;
+	move_to_node( p->w[from], cells*sizeof(cell_t), node );
+	move_to_node( p->btime[from], cells*sizeof(int), node );
+	move_to_node( p->dtime[from], cells*sizeof(int), node );
+}
 
 void* main_worker( void* args ){
 	Elem read ;
 	/* prendo dagli argomenti la propria struttura di worker */
 	int wid = *(int*)args;
+	/* le variazioni dei contatori vanno nel proprio descrittore */
+	self = workers + wid;
+	/* prima mi lego alla cpu, così la fascia finisce sul suo nodo */
+	if ( pin_workers ) pin_worker( wid );
+	if ( worker_bands ) place_band( wid );
 	
 	/* inizializzo i segnali */ 
 	setSignals();
@@ -204,11 +754,27 @@ void* main_worker( void* args ){
 	}
 
 	do
-		if (( read = sycqueue_dequeue( sm_pool ) )) {	
+		if (( read = sycqueue_dequeue( self->pool ) )) {	
 			/* Ho ricevuto la richiesta di elaborare una sotto matrice */ 
 			sub_planet_t *sub_plan = read;
+			/* la memoria di lavoro della sotto matrice precedente non serve più */
+			arena_reset( self->scratch );
+			/* i worker scorrono il pianeta a fasce di sotto matrici: all'inizio di una fascia
+			 * chiedo al kernel di caricare la successiva (solo se il pianeta è su file) */
+			if ( sub_plan->_col == 0 )
+				planet_advise( ((wator_t*)syc_wator->sharedItem)->plan, sub_plan->_row + K, K, MADV_WILLNEED );
+			/* il costo è il numero di animali aggiornati in questo chronon ( owner computes: nella prima fase ) */
+			if ( ! owner_computes || owner_phase == OWNER_UPDATE ) sub_plan->cost = 0;
 			/* aggiorno la sotto matrice */
-			sub_update_wator( sub_plan );
+			if ( speculative ) spec_update_wator( sub_plan );
+			else if ( ! owner_computes ) sub_update_wator( sub_plan );
+			else if ( owner_phase == OWNER_UPDATE ) owner_update( sub_plan );
+			else owner_apply( sub_plan );
+			/* se il chronon verrà visualizzato la comprimo finchè è in cache
+			 * ( in owner computes la sotto matrice è definitiva solo dopo la seconda fase ) */
+			if ( encode_round && ( ! owner_computes || owner_phase == OWNER_APPLY ) ) encode_slot( sub_plan );
+			/* una sotto matrice con animali resta attiva; una senza lo torna solo se qualcuno vi arriva */
+			if ( sub_plan->cost ) wake_tile( sub_plan - sub_planets );
 			/* comunico al collector che ho finito */
 			sycqueue_enqueue( TO_COLLECTOR_QUEUE, &wid );
 		}/* else ho ricevuto EVENT_QUEUE_MSG_EXIT */